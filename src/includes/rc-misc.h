@@ -44,6 +44,9 @@
 #define RC_LEVEL_DEFAULT        "default"
 
 #define RC_DEPTREE_CACHE        RC_SVCDIR "/deptree"
+#define RC_DEPTREE_BIN          RC_SVCDIR "/deptree.bin"
+#define RC_DEPTREE_RAW          RC_SVCDIR "/deptree.raw"
+#define RC_STATEDB              RC_SVCDIR "/statedb"
 #define RC_DEPTREE_SKEWED	RC_SVCDIR "/clock-skewed"
 #define RC_KRUNLEVEL            RC_SVCDIR "/krunlevel"
 #define RC_STARTING             RC_SVCDIR "/rc.starting"
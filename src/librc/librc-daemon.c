@@ -32,167 +32,270 @@
 #include "librc.h"
 
 #if defined(__linux__) || (defined (__FreeBSD_kernel__) && defined(__GLIBC__))
+
+/*
+  We never match RC_RUNSCRIPT_PID if present so we avoid the below
+  scenario
+
+  /etc/init.d/ntpd stop does
+  start-stop-daemon --stop --name ntpd
+  catching /etc/init.d/ntpd stop
+
+  nasty
+*/
+static pid_t
+runscript_pid(void)
+{
+	char *pp;
+	pid_t pid;
+
+	if ((pp = getenv("RC_RUNSCRIPT_PID")) && sscanf(pp, "%d", &pid) == 1)
+		return pid;
+	return 0;
+}
+
+/* What we have read about each process so far */
+#define PROC_UID	0x01
+#define PROC_COMM	0x02
+#define PROC_ARGV	0x04
+#define PROC_ENVID	0x08
+#define PROC_GONE	0x10
+
+typedef struct rc_proc {
+	pid_t pid;
+	int flags;
+	uid_t uid;
+	bool container;
+	char *comm;
+	char *argv;		/* NUL separated */
+	size_t argvlen;
+} RC_PROC;
+
+struct rc_procs {
+	int dirfd;		/* /proc, which we open everything under */
+	bool openvz_host;
+	pid_t runscript_pid;
+	size_t nprocs;
+	RC_PROC *procs;
+};
+
+/* Read a file about a process, relative to /proc */
+static ssize_t
+proc_read(RC_PROCS *procs, RC_PROC *proc, const char *name,
+    char *buffer, size_t len)
+{
+	char file[32];
+	ssize_t bytes;
+	int fd;
+
+	snprintf(file, sizeof(file), "%d/%s", proc->pid, name);
+	if ((fd = openat(procs->dirfd, file, O_RDONLY | O_CLOEXEC)) == -1) {
+		proc->flags |= PROC_GONE;
+		return -1;
+	}
+	bytes = read(fd, buffer, len - 1);
+	close(fd);
+	if (bytes == -1) {
+		proc->flags |= PROC_GONE;
+		return -1;
+	}
+	buffer[bytes] = '\0';
+	return bytes;
+}
+
 static bool
-pid_is_exec(pid_t pid, const char *exec)
+proc_is_uid(RC_PROCS *procs, RC_PROC *proc, uid_t uid)
 {
-	char buffer[32];
-	FILE *fp;
-	int c;
-	bool retval = false;
+	char file[16];
+	struct stat sb;
 
-	exec = basename_c(exec);
-	snprintf(buffer, sizeof(buffer), "/proc/%d/stat", pid);
-	if ((fp = fopen(buffer, "r"))) {
-		while ((c = getc(fp)) != EOF && c != '(')
-			;
-		if (c == '(') {
-			while ((c = getc(fp)) != EOF && c == *exec)
-				exec++;
-			if (c == ')' && *exec == '\0')
-				retval = true;
+	if (!(proc->flags & PROC_UID)) {
+		snprintf(file, sizeof(file), "%d", proc->pid);
+		if (fstatat(procs->dirfd, file, &sb, 0) != 0)
+			proc->flags |= PROC_GONE;
+		else
+			proc->uid = sb.st_uid;
+		proc->flags |= PROC_UID;
+	}
+	return !(proc->flags & PROC_GONE) && proc->uid == uid;
+}
+
+static bool
+proc_is_exec(RC_PROCS *procs, RC_PROC *proc, const char *exec)
+{
+	char buffer[512], *p, *e;
+
+	if (!(proc->flags & PROC_COMM)) {
+		proc->flags |= PROC_COMM;
+		/* The name is in brackets, and can contain them */
+		if (proc_read(procs, proc, "stat", buffer, sizeof(buffer)) > 0 &&
+		    (p = strchr(buffer, '(')) && (e = strrchr(p, ')')))
+		{
+			*e = '\0';
+			proc->comm = xstrdup(p + 1);
 		}
-		fclose(fp);
 	}
-	return retval;
+	return proc->comm && strcmp(proc->comm, exec) == 0;
 }
 
 static bool
-pid_is_argv(pid_t pid, const char *const *argv)
+proc_is_argv(RC_PROCS *procs, RC_PROC *proc, const char *const *argv)
 {
-	char cmdline[32];
-	int fd;
 	char buffer[PATH_MAX];
-	char *p;
 	ssize_t bytes;
-
-	snprintf(cmdline, sizeof(cmdline), "/proc/%u/cmdline", pid);
-	if ((fd = open(cmdline, O_RDONLY)) < 0)
-		return false;
-	bytes = read(fd, buffer, sizeof(buffer));
-	close(fd);
-	if (bytes == -1)
+	size_t len;
+	const char *p;
+
+	if (!(proc->flags & PROC_ARGV)) {
+		proc->flags |= PROC_ARGV;
+		if ((bytes = proc_read(procs, proc, "cmdline",
+			    buffer, sizeof(buffer))) != -1)
+		{
+			proc->argv = xmalloc(bytes + 1);
+			memcpy(proc->argv, buffer, bytes + 1);
+			proc->argvlen = bytes;
+		}
+	}
+	if (!proc->argv)
 		return false;
 
-	buffer[bytes] = '\0';
-	p = buffer;
+	p = proc->argv;
 	while (*argv) {
-		if (strcmp(*argv, p) != 0)
+		if ((size_t)(p - proc->argv) > proc->argvlen ||
+		    strcmp(*argv, p) != 0)
 			return false;
+		len = strlen(p) + 1;
 		argv++;
-		p += strlen(p) + 1;
-		if ((unsigned)(p - buffer) > sizeof(buffer))
-			return false;
+		p += len;
 	}
 	return true;
 }
 
-RC_PIDLIST *
-rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
+/* If this is an OpenVZ host, filter out container processes */
+static bool
+proc_is_container(RC_PROCS *procs, RC_PROC *proc)
+{
+	char buffer[BUFSIZ], *p;
+
+	if (!procs->openvz_host)
+		return false;
+	if (!(proc->flags & PROC_ENVID)) {
+		proc->flags |= PROC_ENVID;
+		if (proc_read(procs, proc, "status",
+			buffer, sizeof(buffer)) > 0 &&
+		    (p = strstr(buffer, "\nenvID:")))
+			proc->container = strncmp(p + 1, "envID:\t0", 8) != 0;
+	}
+	return proc->container;
+}
+
+RC_PROCS *
+rc_procs_new(void)
 {
+	RC_PROCS *procs;
 	DIR *procdir;
 	struct dirent *entry;
-	FILE *fp;
-	bool container_pid = false;
-	bool openvz_host = false;
-	char *line = NULL;
-	size_t len = 0;
+	char buffer[BUFSIZ];
+	size_t size = 0;
+	RC_PROC self;
 	pid_t p;
-	char buffer[PATH_MAX];
-	struct stat sb;
-	pid_t runscript_pid = 0;
-	char *pp;
-	RC_PIDLIST *pids = NULL;
-	RC_PID *pi;
+	int fd;
 
-	if ((procdir = opendir("/proc")) == NULL)
+	if ((fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return NULL;
+	if ((procdir = fdopendir(dup(fd))) == NULL) {
+		close(fd);
 		return NULL;
-
-	/*
-	  We never match RC_RUNSCRIPT_PID if present so we avoid the below
-	  scenario
-
-	  /etc/init.d/ntpd stop does
-	  start-stop-daemon --stop --name ntpd
-	  catching /etc/init.d/ntpd stop
-
-	  nasty
-	*/
-
-	if ((pp = getenv("RC_RUNSCRIPT_PID"))) {
-		if (sscanf(pp, "%d", &runscript_pid) != 1)
-			runscript_pid = 0;
 	}
 
+	procs = xmalloc(sizeof(*procs));
+	memset(procs, 0, sizeof(*procs));
+	procs->dirfd = fd;
+	procs->runscript_pid = runscript_pid();
+
 	/*
-	If /proc/self/status contains EnvID: 0, then we are an OpenVZ host,
+	If /proc/self/status contains envID: 0, then we are an OpenVZ host,
 	and we will need to filter out processes that are inside containers
 	from our list of pids.
 	*/
+	memset(&self, 0, sizeof(self));
+	self.pid = getpid();
+	if (proc_read(procs, &self, "status", buffer, sizeof(buffer)) > 0)
+		procs->openvz_host = strstr(buffer, "\nenvID:\t0\n") != NULL;
 
-	if (exists("/proc/self/status")) {
-		fp = fopen("/proc/self/status", "r");
-		if (fp) {
-			while (! feof(fp)) {
-				rc_getline(&line, &len, fp);
-				if (strncmp(line, "envID:\t0", 8) == 0) {
-					openvz_host = true;
-					break;
-				}
-			}
-			fclose(fp);
+	while ((entry = readdir(procdir)) != NULL) {
+		if (sscanf(entry->d_name, "%d", &p) != 1)
+			continue;
+		if (procs->nprocs == size) {
+			size = size ? size * 2 : 256;
+			procs->procs = xrealloc(procs->procs,
+			    sizeof(*procs->procs) * size);
 		}
+		memset(&procs->procs[procs->nprocs], 0,
+		    sizeof(*procs->procs));
+		procs->procs[procs->nprocs++].pid = p;
 	}
+	closedir(procdir);
+	return procs;
+}
+librc_hidden_def(rc_procs_new)
 
-	while ((entry = readdir(procdir)) != NULL) {
-		if (sscanf(entry->d_name, "%d", &p) != 1)
+void
+rc_procs_free(RC_PROCS *procs)
+{
+	size_t i;
+
+	if (!procs)
+		return;
+	for (i = 0; i < procs->nprocs; i++) {
+		free(procs->procs[i].comm);
+		free(procs->procs[i].argv);
+	}
+	free(procs->procs);
+	close(procs->dirfd);
+	free(procs);
+}
+librc_hidden_def(rc_procs_free)
+
+RC_PIDLIST *
+rc_procs_find(RC_PROCS *procs, const char *exec, const char *const *argv,
+    uid_t uid, pid_t pid)
+{
+	RC_PIDLIST *pids = NULL;
+	RC_PROC *proc;
+	RC_PID *pi;
+	size_t i;
+
+	if (exec)
+		exec = basename_c(exec);
+	for (i = 0; i < procs->nprocs; i++) {
+		proc = &procs->procs[i];
+		if (procs->runscript_pid != 0 &&
+		    procs->runscript_pid == proc->pid)
 			continue;
-		if (runscript_pid != 0 && runscript_pid == p)
+		if (pid != 0 && pid != proc->pid)
 			continue;
-		if (pid != 0 && pid != p)
+		if (proc->flags & PROC_GONE)
 			continue;
-		if (uid) {
-			snprintf(buffer, sizeof(buffer), "/proc/%d", p);
-			if (stat(buffer, &sb) != 0 || sb.st_uid != uid)
-				continue;
-		}
-		if (exec && !pid_is_exec(p, exec))
+		if (uid && !proc_is_uid(procs, proc, uid))
 			continue;
-		if (argv &&
-		    !pid_is_argv(p, (const char *const *)argv))
+		if (exec && !proc_is_exec(procs, proc, exec))
 			continue;
-		/* If this is an OpenVZ host, filter out container processes */
-		if (openvz_host) {
-			snprintf(buffer, sizeof(buffer), "/proc/%d/status", p);
-			if (exists(buffer)) {
-				fp = fopen(buffer, "r");
-				if (! fp)
-					continue;
-				while (! feof(fp)) {
-					rc_getline(&line, &len, fp);
-					if (strncmp(line, "envID:", 6) == 0) {
-						container_pid = ! (strncmp(line, "envID:\t0", 8) == 0);
-						break;
-					}
-				}
-				fclose(fp);
-			}
-		}
-		if (container_pid)
+		if (argv && !proc_is_argv(procs, proc, argv))
+			continue;
+		if (proc_is_container(procs, proc))
 			continue;
 		if (!pids) {
 			pids = xmalloc(sizeof(*pids));
 			LIST_INIT(pids);
 		}
 		pi = xmalloc(sizeof(*pi));
-		pi->pid = p;
+		pi->pid = proc->pid;
 		LIST_INSERT_HEAD(pids, pi, entries);
 	}
-	if (line != NULL)
-		free(line);
-	closedir(procdir);
 	return pids;
 }
-librc_hidden_def(rc_find_pids)
+librc_hidden_def(rc_procs_find)
 
 #elif BSD
 
@@ -224,43 +327,73 @@ librc_hidden_def(rc_find_pids)
 #  define _KVM_FLAGS O_RDONLY
 # endif
 
-RC_PIDLIST *
-rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
+struct rc_procs {
+	kvm_t *kd;
+	struct _KINFO_PROC *kp;
+	int processes;
+};
+
+RC_PROCS *
+rc_procs_new(void)
 {
-	static kvm_t *kd = NULL;
 	char errbuf[_POSIX2_LINE_MAX];
-	struct _KINFO_PROC *kp;
-	int i;
-	int processes = 0;
-	int pargc = 0;
-	char **pargv;
-	RC_PIDLIST *pids = NULL;
-	RC_PID *pi;
-	pid_t p;
-	const char *const *arg;
-	int match;
+	RC_PROCS *procs;
 
-	if ((kd = kvm_openfiles(_KVM_PATH, _KVM_PATH,
+	procs = xmalloc(sizeof(*procs));
+	if ((procs->kd = kvm_openfiles(_KVM_PATH, _KVM_PATH,
 		    NULL, _KVM_FLAGS, errbuf)) == NULL)
 	{
 		fprintf(stderr, "kvm_open: %s\n", errbuf);
+		free(procs);
 		return NULL;
 	}
 
 #ifdef _KVM_GETPROC2
-	kp = kvm_getproc2(kd, KERN_PROC_ALL, 0, sizeof(*kp), &processes);
+	procs->kp = kvm_getproc2(procs->kd, KERN_PROC_ALL, 0,
+	    sizeof(*procs->kp), &procs->processes);
 #else
-	kp = kvm_getprocs(kd, KERN_PROC_PROC, 0, &processes);
+	procs->kp = kvm_getprocs(procs->kd, KERN_PROC_PROC, 0,
+	    &procs->processes);
 #endif
-	if ((kp == NULL && processes > 0) || (kp != NULL && processes < 0)) {
-		fprintf(stderr, "kvm_getprocs: %s\n", kvm_geterr(kd));
-		kvm_close(kd);
+	if ((procs->kp == NULL && procs->processes > 0) ||
+	    (procs->kp != NULL && procs->processes < 0))
+	{
+		fprintf(stderr, "kvm_getprocs: %s\n", kvm_geterr(procs->kd));
+		kvm_close(procs->kd);
+		free(procs);
 		return NULL;
 	}
+	return procs;
+}
+librc_hidden_def(rc_procs_new)
+
+void
+rc_procs_free(RC_PROCS *procs)
+{
+	if (!procs)
+		return;
+	kvm_close(procs->kd);
+	free(procs);
+}
+librc_hidden_def(rc_procs_free)
+
+RC_PIDLIST *
+rc_procs_find(RC_PROCS *procs, const char *exec, const char *const *argv,
+    uid_t uid, pid_t pid)
+{
+	struct _KINFO_PROC *kp = procs->kp;
+	int i;
+	int pargc = 0;
+	char **pargv;
+	RC_PIDLIST *pids = NULL;
+	RC_PID *pi;
+	pid_t p;
+	const char *const *arg;
+	int match;
 
 	if (exec)
 		exec = basename_c(exec);
-	for (i = 0; i < processes; i++) {
+	for (i = 0; i < procs->processes; i++) {
 		p = _GET_KINFO_PID(kp[i]);
 		if (pid != 0 && pid != p)
 			continue;
@@ -272,7 +405,7 @@ rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
 				continue;
 		}
 		if (argv && *argv) {
-			pargv = _KVM_GETARGV(kd, &kp[i], pargc);
+			pargv = _KVM_GETARGV(procs->kd, &kp[i], pargc);
 			if (!pargv || !*pargv)
 				continue;
 			arg = argv;
@@ -293,16 +426,29 @@ rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
 		pi->pid = p;
 		LIST_INSERT_HEAD(pids, pi, entries);
 	}
-	kvm_close(kd);
 
 	return pids;
 }
-librc_hidden_def(rc_find_pids)
+librc_hidden_def(rc_procs_find)
 
 #else
 #  error "Platform not supported!"
 #endif
 
+RC_PIDLIST *
+rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
+{
+	RC_PROCS *procs;
+	RC_PIDLIST *pids;
+
+	if (!(procs = rc_procs_new()))
+		return NULL;
+	pids = rc_procs_find(procs, exec, argv, uid, pid);
+	rc_procs_free(procs);
+	return pids;
+}
+librc_hidden_def(rc_find_pids)
+
 static bool
 _match_daemon(const char *path, const char *file, RC_STRINGLIST *match)
 {
@@ -487,7 +633,7 @@ rc_service_started_daemon(const char *service,
 librc_hidden_def(rc_service_started_daemon)
 
 bool
-rc_service_daemons_crashed(const char *service)
+rc_procs_daemons_crashed(RC_PROCS *procs, const char *service)
 {
 	char dirpath[PATH_MAX];
 	DIR *dp;
@@ -510,6 +656,7 @@ rc_service_daemons_crashed(const char *service)
 	RC_STRINGLIST *list = NULL;
 	RC_STRING *s;
 	size_t i;
+	RC_PROCS *snapshot = NULL;
 
 	path += snprintf(dirpath, sizeof(dirpath), RC_SVCDIR "/daemons/%s",
 	    basename_c(service));
@@ -610,19 +757,23 @@ rc_service_daemons_crashed(const char *service)
 			if (pid != 0) {
 				if (kill(pid, 0) == -1 && errno == ESRCH)
 					retval = true;
-			} else if ((pids = rc_find_pids(exec,
-				    (const char *const *)argv,
-				    0, pid)))
-			{
-				p1 = LIST_FIRST(pids);
-				while (p1) {
-					p2 = LIST_NEXT(p1, entries);
-					free(p1);
-					p1 = p2;
-				}
-				free(pids);
-			} else
-				retval = true;
+			} else {
+				/* One snapshot does for all our daemons */
+				if (!procs)
+					procs = snapshot = rc_procs_new();
+				if (procs && (pids = rc_procs_find(procs, exec,
+					    (const char *const *)argv, 0, pid)))
+				{
+					p1 = LIST_FIRST(pids);
+					while (p1) {
+						p2 = LIST_NEXT(p1, entries);
+						free(p1);
+						p1 = p2;
+					}
+					free(pids);
+				} else
+					retval = true;
+			}
 		}
 		rc_stringlist_free(list);
 		list = NULL;
@@ -637,7 +788,15 @@ rc_service_daemons_crashed(const char *service)
 	}
 	closedir(dp);
 	free(line);
+	rc_procs_free(snapshot);
 
 	return retval;
 }
+librc_hidden_def(rc_procs_daemons_crashed)
+
+bool
+rc_service_daemons_crashed(const char *service)
+{
+	return rc_procs_daemons_crashed(NULL, service);
+}
 librc_hidden_def(rc_service_daemons_crashed)
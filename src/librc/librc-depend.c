@@ -30,15 +30,114 @@
 
 #include <sys/utsname.h>
 
+#include <poll.h>
+
 #include "queue.h"
 #include "librc.h"
 
 #define GENDEP          RC_LIBEXECDIR "/sh/gendepends.sh"
 
 #define RC_DEPCONFIG    RC_SVCDIR "/depconfig"
+#define RC_DEPMANIFEST  RC_SVCDIR "/depmanifest"
+#define RC_DEPORDERDIR  RC_SVCDIR "/deporder"
+#define RC_DEPFRESH     RC_SVCDIR "/depfresh"
+#define RC_SHLIB        RC_SVCDIR "/runscript-functions.sh"
+#define RC_LIVECD_SHLIB "/sbin/livecd-functions.sh"
+
+#define RC_DEPMANIFEST_MAGIC	"RCmanifest 2"
+#define RC_DEPORDER_MAGIC	"RCorder 1"
+
+/* Editing a file in place keeps its size and inode and can keep its
+ * second, so we need the nanoseconds too where there are any */
+#if defined(__APPLE__)
+#  define MTIME_NSEC(st)	((long)(st)->st_mtimespec.tv_nsec)
+#elif defined(st_mtime)
+#  define MTIME_NSEC(st)	((long)(st)->st_mtim.tv_nsec)
+#else
+#  define MTIME_NSEC(st)	0L
+#endif
+
+#define RC_DEPTREE_MAGIC	"RCdt"
+#define RC_DEPTREE_VERSION	3
+
+/* The binary deptree is a single image which we mmap and query in place.
+ * It starts with a header, followed by the service table, the hash index
+ * of service names, the reference table and finally the string table.
+ * Table positions in the header are byte offsets from the start of the
+ * image, everything else is an index into the relevant table.
+ * The checksum covers everything after the header so anything cached
+ * against a deptree can tell if it has changed.
+ * It never leaves the host that wrote it, so we use host byte order. */
+typedef struct dt_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t size;
+	uint32_t nservices;
+	uint32_t services;
+	uint32_t nbuckets;
+	uint32_t buckets;
+	uint32_t nrefs;
+	uint32_t refs;
+	uint32_t strings;
+	uint32_t strsize;
+	uint32_t sum;
+} DT_HEADER;
+
+/* A run of the reference table */
+typedef struct dt_deptype {
+	uint32_t ref;
+	uint32_t nrefs;
+} DT_DEPTYPE;
+
+typedef struct dt_service {
+	uint32_t name;
+	DT_DEPTYPE deptypes[RC_DT_MAX];
+} DT_SERVICE;
+
+struct rc_deptree {
+	char *image;
+	size_t size;
+	bool mapped;
+	const DT_HEADER *header;
+	const DT_SERVICE *services;
+	const uint32_t *buckets;
+	const uint32_t *refs;
+	const char *strings;
+};
+
+/* Must match the order of RC_DT */
+static const char *const deptype_names[RC_DT_MAX] = {
+	"ineed",
+	"iuse",
+	"iafter",
+	"ibefore",
+	"iprovide",
+	"providedby",
+	"needsme",
+	"usesme",
+	"keyword",
+	"broken",
+};
+
+/* Open addressing index of a dependency list, keyed by service name */
+typedef struct depindex {
+	RC_DEPINFO **slots;
+	size_t size;
+	size_t count;
+} DEPINDEX;
 
 static const char *bootlevel = NULL;
 
+/* The choices rc_deptree_order made from service state, if we are going
+ * to cache the order */
+static RC_STRINGLIST *decisions = NULL;
+
+/* The state of every service, read once for each call which needs it */
+static RC_SERVICE_STATES *states = NULL;
+
+/* How many providedby lookups we answered from a walk's cache */
+static unsigned long provided_hits = 0;
+
 static char *
 get_shell_value(char *string)
 {
@@ -63,18 +162,130 @@ get_shell_value(char *string)
 	return NULL;
 }
 
-void
-rc_deptree_free(RC_DEPTREE *deptree)
+static int
+deptype_intern(const char *type)
+{
+	int i;
+
+	for (i = 0; i < RC_DT_MAX; i++)
+		if (strcmp(deptype_names[i], type) == 0)
+			return i;
+	return -1;
+}
+
+/* FNV-1a */
+static uint32_t
+hash_service(const char *service)
+{
+	uint32_t h = 2166136261U;
+
+	while (*service) {
+		h ^= (unsigned char)*service++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void
+depindex_add(DEPINDEX *index, RC_DEPINFO *depinfo)
+{
+	RC_DEPINFO **slots;
+	size_t size, i, j;
+
+	/* Keep the load factor under a half */
+	if ((index->count + 1) * 2 > index->size) {
+		slots = index->slots;
+		size = index->size;
+		index->size = size ? size * 2 : 64;
+		index->slots = xmalloc(sizeof(*index->slots) * index->size);
+		memset(index->slots, 0, sizeof(*index->slots) * index->size);
+		index->count = 0;
+		for (j = 0; j < size; j++)
+			if (slots[j])
+				depindex_add(index, slots[j]);
+		free(slots);
+	}
+
+	i = hash_service(depinfo->service) & (index->size - 1);
+	while (index->slots[i]) {
+		/* The first service of a name wins, like a list walk */
+		if (strcmp(index->slots[i]->service, depinfo->service) == 0)
+			return;
+		i = (i + 1) & (index->size - 1);
+	}
+	index->slots[i] = depinfo;
+	index->count++;
+}
+
+static void
+depindex_build(DEPINDEX *index, const RC_DEPLIST *deplist)
+{
+	RC_DEPINFO *di;
+
+	free(index->slots);
+	memset(index, 0, sizeof(*index));
+	TAILQ_FOREACH(di, deplist, entries)
+		depindex_add(index, di);
+}
+
+static RC_DEPINFO *
+get_depinfo(const DEPINDEX *index, const char *service)
+{
+	size_t i;
+
+	if (!index->size)
+		return NULL;
+	i = hash_service(service) & (index->size - 1);
+	while (index->slots[i]) {
+		if (strcmp(index->slots[i]->service, service) == 0)
+			return index->slots[i];
+		i = (i + 1) & (index->size - 1);
+	}
+	return NULL;
+}
+
+static RC_DEPTYPE *
+get_deptype(const RC_DEPINFO *depinfo, RC_DT type)
+{
+	return depinfo->deptypes[type];
+}
+
+static RC_DEPINFO *
+depinfo_new(RC_DEPLIST *deplist, const char *service)
+{
+	RC_DEPINFO *depinfo = xmalloc(sizeof(*depinfo));
+
+	TAILQ_INIT(&depinfo->depends);
+	memset(depinfo->deptypes, 0, sizeof(depinfo->deptypes));
+	depinfo->service = xstrdup(service);
+	TAILQ_INSERT_TAIL(deplist, depinfo, entries);
+	return depinfo;
+}
+
+static RC_DEPTYPE *
+deptype_new(RC_DEPINFO *depinfo, RC_DT type)
+{
+	RC_DEPTYPE *deptype = xmalloc(sizeof(*deptype));
+
+	deptype->type = xstrdup(deptype_names[type]);
+	deptype->services = rc_stringlist_new();
+	TAILQ_INSERT_TAIL(&depinfo->depends, deptype, entries);
+	depinfo->deptypes[type] = deptype;
+	return deptype;
+}
+
+static void
+deplist_free(RC_DEPLIST *deplist)
 {
 	RC_DEPINFO *di;
 	RC_DEPINFO *di2;
 	RC_DEPTYPE *dt;
 	RC_DEPTYPE *dt2;
 
-	if (!deptree)
+	if (!deplist)
 		return;
 
-	di = TAILQ_FIRST(deptree);
+	di = TAILQ_FIRST(deplist);
 	while (di) {
 		di2 = TAILQ_NEXT(di, entries);
 		dt = TAILQ_FIRST(&di->depends);
@@ -89,34 +300,310 @@ rc_deptree_free(RC_DEPTREE *deptree)
 		free(di);
 		di = di2;
 	}
+	free(deplist);
+}
+
+void
+rc_deptree_free(RC_DEPTREE *deptree)
+{
+	if (!deptree)
+		return;
+
+	if (deptree->mapped)
+		munmap(deptree->image, deptree->size);
+	else
+		free(deptree->image);
 	free(deptree);
 }
 librc_hidden_def(rc_deptree_free)
 
-static RC_DEPINFO *
-get_depinfo(const RC_DEPTREE *deptree, const char *service)
+/* Flatten a dependency list into a binary image */
+static char *
+deptree_compile(const RC_DEPLIST *deplist, size_t *size)
 {
 	RC_DEPINFO *di;
+	RC_DEPTYPE *dt;
+	RC_STRING *s;
+	DT_HEADER *header;
+	DT_SERVICE *svc, *svcs;
+	uint32_t *bucket, *ref;
+	char *image, *strings;
+	size_t nservices = 0, nbuckets, nrefs = 0, strsize = 0;
+	size_t len, i, j;
+	int t;
+
+	TAILQ_FOREACH(di, deplist, entries) {
+		nservices++;
+		strsize += strlen(di->service) + 1;
+		for (t = 0; t < RC_DT_MAX; t++) {
+			if (!(dt = di->deptypes[t]))
+				continue;
+			TAILQ_FOREACH(s, dt->services, entries) {
+				nrefs++;
+				strsize += strlen(s->value) + 1;
+			}
+		}
+	}
+
+	/* Always leave an empty bucket so lookups terminate */
+	for (nbuckets = 16; nbuckets < nservices * 2; nbuckets *= 2)
+		;
+
+	len = sizeof(*header) +
+	    nservices * sizeof(*svc) +
+	    nbuckets * sizeof(*bucket) +
+	    nrefs * sizeof(*ref) +
+	    strsize;
+	if (len > UINT32_MAX) {
+		errno = EFBIG;
+		return NULL;
+	}
+
+	image = xmalloc(len);
+	memset(image, 0, len);
+	header = (void *)image;
+	memcpy(header->magic, RC_DEPTREE_MAGIC, sizeof(header->magic));
+	header->version = RC_DEPTREE_VERSION;
+	header->size = len;
+	header->nservices = nservices;
+	header->services = sizeof(*header);
+	header->nbuckets = nbuckets;
+	header->buckets = header->services + nservices * sizeof(*svc);
+	header->nrefs = nrefs;
+	header->refs = header->buckets + nbuckets * sizeof(*bucket);
+	header->strings = header->refs + nrefs * sizeof(*ref);
+	header->strsize = strsize;
+
+	svc = svcs = (void *)(image + header->services);
+	bucket = (void *)(image + header->buckets);
+	ref = (void *)(image + header->refs);
+	strings = image + header->strings;
+
+#define ADD_STRING(_s) \
+	len = strlen(_s) + 1; \
+	memcpy(strings + strsize, _s, len); \
+	strsize += len;
+
+	strsize = j = 0;
+	TAILQ_FOREACH(di, deplist, entries) {
+		svc->name = strsize;
+		ADD_STRING(di->service);
+		for (t = 0; t < RC_DT_MAX; t++) {
+			svc->deptypes[t].ref = j;
+			if (!(dt = di->deptypes[t]))
+				continue;
+			TAILQ_FOREACH(s, dt->services, entries) {
+				ref[j++] = strsize;
+				svc->deptypes[t].nrefs++;
+				ADD_STRING(s->value);
+			}
+		}
+
+		/* Bucket values are the service index plus one, so zero
+		 * is empty. The first service of a name wins. */
+		i = hash_service(di->service) & (nbuckets - 1);
+		while (bucket[i] &&
+		    strcmp(strings + svcs[bucket[i] - 1].name, di->service) != 0)
+			i = (i + 1) & (nbuckets - 1);
+		if (!bucket[i])
+			bucket[i] = (svc - svcs) + 1;
+		svc++;
+	}
+#undef ADD_STRING
+
+	/* FNV-1a, as for service names */
+	header->sum = 2166136261U;
+	for (i = sizeof(*header); i < header->size; i++) {
+		header->sum ^= (unsigned char)image[i];
+		header->sum *= 16777619U;
+	}
+
+	*size = header->size;
+	return image;
+}
+
+/* Check the image is sane before we trust any offsets inside it */
+static RC_DEPTREE *
+deptree_new(char *image, size_t size, bool mapped)
+{
+	RC_DEPTREE *deptree;
+	const DT_HEADER *header = (const void *)image;
+	const DT_SERVICE *svc;
+	const uint32_t *bucket;
+	uint32_t i;
+	int t;
+
+	if (size < sizeof(*header) ||
+	    memcmp(header->magic, RC_DEPTREE_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != RC_DEPTREE_VERSION ||
+	    header->size != size)
+		goto invalid;
+
+	if (header->services % sizeof(uint32_t) != 0 ||
+	    header->services < sizeof(*header) ||
+	    header->services > size ||
+	    header->nservices > (size - header->services) / sizeof(*svc) ||
+	    header->buckets % sizeof(uint32_t) != 0 ||
+	    header->buckets < sizeof(*header) ||
+	    header->buckets > size ||
+	    header->nbuckets > (size - header->buckets) / sizeof(uint32_t) ||
+	    header->nbuckets <= header->nservices ||
+	    (header->nbuckets & (header->nbuckets - 1)) != 0 ||
+	    header->refs % sizeof(uint32_t) != 0 ||
+	    header->refs < sizeof(*header) ||
+	    header->refs > size ||
+	    header->nrefs > (size - header->refs) / sizeof(uint32_t) ||
+	    header->strings > size ||
+	    header->strsize == 0 ||
+	    header->strsize > size - header->strings ||
+	    image[header->strings + header->strsize - 1] != '\0')
+		goto invalid;
+
+	svc = (const void *)(image + header->services);
+	for (i = 0; i < header->nservices; i++, svc++)
+		for (t = 0; t < RC_DT_MAX; t++)
+			if (svc->deptypes[t].ref > header->nrefs ||
+			    svc->deptypes[t].nrefs >
+			    header->nrefs - svc->deptypes[t].ref)
+				goto invalid;
+	bucket = (const void *)(image + header->buckets);
+	for (i = 0; i < header->nbuckets; i++, bucket++)
+		if (*bucket > header->nservices)
+			goto invalid;
 
-	TAILQ_FOREACH(di, deptree, entries)
-		if (strcmp(di->service, service) == 0)
-			return di;
+	deptree = xmalloc(sizeof(*deptree));
+	deptree->image = image;
+	deptree->size = size;
+	deptree->mapped = mapped;
+	deptree->header = header;
+	deptree->services = (const void *)(image + header->services);
+	deptree->buckets = (const void *)(image + header->buckets);
+	deptree->refs = (const void *)(image + header->refs);
+	deptree->strings = image + header->strings;
+	return deptree;
+
+invalid:
+	if (mapped)
+		munmap(image, size);
+	else
+		free(image);
+	errno = EINVAL;
 	return NULL;
 }
 
-static RC_DEPTYPE *
-get_deptype(const RC_DEPINFO *depinfo, const char *type)
+static RC_DEPTREE *
+deptree_map(int fd)
 {
-	RC_DEPTYPE *dt;
+	struct stat st;
+	void *image;
+
+	if (fstat(fd, &st) != 0)
+		return NULL;
+	if (st.st_size < (off_t)sizeof(DT_HEADER) || st.st_size > UINT32_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (image == MAP_FAILED)
+		return NULL;
+	return deptree_new(image, st.st_size, true);
+}
+
+/* Everything we cache is written to a temporary file and renamed over
+ * the old one, so nobody ever reads half a file and anything with the
+ * old one mapped keeps it */
+static FILE *
+save_open(const char *file, char *tmp, size_t len)
+{
+	int r;
+
+	r = snprintf(tmp, len, "%s.%d", file, (int)getpid());
+	if (r < 0 || (size_t)r >= len) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	return fopen(tmp, "w");
+}
+
+static bool
+save_close(FILE *fp, const char *tmp, const char *file, bool ok)
+{
+	if (fclose(fp) != 0 || !ok || rename(tmp, file) != 0) {
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+static bool
+deptree_save(const char *file, const char *image, size_t size)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	if (!(fp = save_open(file, tmp, sizeof(tmp))))
+		return false;
+	return save_close(fp, tmp, file,
+	    fwrite(image, 1, size, fp) == size);
+}
+
+static const char *
+dt_string(const RC_DEPTREE *deptree, uint32_t offset)
+{
+	if (offset >= deptree->header->strsize)
+		return "";
+	return deptree->strings + offset;
+}
+
+static const char *
+dt_ref(const RC_DEPTREE *deptree, const DT_DEPTYPE *deptype, uint32_t i)
+{
+	return dt_string(deptree, deptree->refs[deptype->ref + i]);
+}
 
-	TAILQ_FOREACH(dt, &depinfo->depends, entries)
-		if (strcmp(dt->type, type) == 0)
-			return dt;
+static const DT_SERVICE *
+dt_service(const RC_DEPTREE *deptree, const char *service)
+{
+	const DT_SERVICE *svc;
+	uint32_t mask = deptree->header->nbuckets - 1;
+	uint32_t i;
+
+	i = hash_service(service) & mask;
+	while (deptree->buckets[i]) {
+		svc = deptree->services + deptree->buckets[i] - 1;
+		if (strcmp(dt_string(deptree, svc->name), service) == 0)
+			return svc;
+		i = (i + 1) & mask;
+	}
 	return NULL;
 }
 
+static const DT_DEPTYPE *
+dt_deptype(const DT_SERVICE *svc, RC_DT type)
+{
+	if (svc->deptypes[type].nrefs == 0)
+		return NULL;
+	return &svc->deptypes[type];
+}
+
 RC_DEPTREE *
 rc_deptree_load(void) {
+	struct stat st, bst;
+	RC_DEPTREE *deptree;
+	int fd;
+
+	/* Only trust the binary cache if it was written with or after the
+	 * shell parseable one */
+	if (stat(RC_DEPTREE_CACHE, &st) == 0 &&
+	    stat(RC_DEPTREE_BIN, &bst) == 0 &&
+	    bst.st_mtime >= st.st_mtime &&
+	    (fd = open(RC_DEPTREE_BIN, O_RDONLY | O_CLOEXEC)) != -1)
+	{
+		deptree = deptree_map(fd);
+		close(fd);
+		if (deptree)
+			return deptree;
+	}
 	return rc_deptree_load_file(RC_DEPTREE_CACHE);
 }
 librc_hidden_def(rc_deptree_load)
@@ -126,20 +613,36 @@ rc_deptree_load_file(const char *deptree_file)
 {
 	FILE *fp;
 	RC_DEPTREE *deptree;
+	RC_DEPLIST *deplist;
 	RC_DEPINFO *depinfo = NULL;
 	RC_DEPTYPE *deptype = NULL;
+	char magic[sizeof(RC_DEPTREE_MAGIC) - 1];
+	char *image;
 	char *line = NULL;
 	size_t len = 0;
 	char *type;
 	char *p;
 	char *e;
 	int i;
+	int t;
+	int fd;
 
-	if (!(fp = fopen(deptree_file, "r")))
+	if ((fd = open(deptree_file, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+	if (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+	    memcmp(magic, RC_DEPTREE_MAGIC, sizeof(magic)) == 0)
+	{
+		deptree = deptree_map(fd);
+		close(fd);
+		return deptree;
+	}
+	if (lseek(fd, 0, SEEK_SET) == -1 || !(fp = fdopen(fd, "r"))) {
+		close(fd);
 		return NULL;
+	}
 
-	deptree = xmalloc(sizeof(*deptree));
-	TAILQ_INIT(deptree);
+	deplist = xmalloc(sizeof(*deplist));
+	TAILQ_INIT(deplist);
 	while ((rc_getline(&line, &len, fp)))
 	{
 		p = line;
@@ -156,11 +659,7 @@ rc_deptree_load_file(const char *deptree_file)
 			e = get_shell_value(p);
 			if (! e || *e == '\0')
 				continue;
-			depinfo = xmalloc(sizeof(*depinfo));
-			TAILQ_INIT(&depinfo->depends);
-			depinfo->service = xstrdup(e);
-			TAILQ_INSERT_TAIL(deptree, depinfo, entries);
-			deptype = NULL;
+			depinfo = depinfo_new(deplist, e);
 			continue;
 		}
 		e = strsep(&p, "=");
@@ -168,31 +667,43 @@ rc_deptree_load_file(const char *deptree_file)
 			continue;
 		/* Sanity */
 		e = get_shell_value(p);
-		if (!e || *e == '\0')
+		if (!e || *e == '\0' || !depinfo)
 			continue;
-		if (!deptype || strcmp(deptype->type, type) != 0) {
-			deptype = xmalloc(sizeof(*deptype));
-			deptype->services = rc_stringlist_new();
-			deptype->type = xstrdup(type);
-			TAILQ_INSERT_TAIL(&depinfo->depends, deptype, entries);
-		}
+		if ((t = deptype_intern(type)) == -1)
+			continue;
+		if (!(deptype = get_deptype(depinfo, t)))
+			deptype = deptype_new(depinfo, t);
 		rc_stringlist_add(deptype->services, e);
 	}
 	fclose(fp);
 	free(line);
 
-	return deptree;
+	image = deptree_compile(deplist, &len);
+	deplist_free(deplist);
+	if (!image)
+		return NULL;
+	return deptree_new(image, len, false);
 }
 librc_hidden_def(rc_deptree_load_file)
 
+static RC_SERVICE
+service_state(const char *service)
+{
+	if (!states)
+		states = rc_service_states_load();
+	return rc_service_states_get(states, service);
+}
+
 static bool
-valid_service(const char *runlevel, const char *service, const char *type)
+valid_service(const char *runlevel, const char *service, RC_DT type)
 {
 	RC_SERVICE state;
+	char decision[PATH_MAX];
+	bool valid;
 
 	if (!runlevel ||
-	    strcmp(type, "ineed") == 0 ||
-	    strcmp(type, "needsme") == 0)
+	    type == RC_DT_INEED ||
+	    type == RC_DT_NEEDSME)
 		return true;
 
 	if (rc_service_in_runlevel(service, runlevel))
@@ -200,36 +711,40 @@ valid_service(const char *runlevel, const char *service, const char *type)
 	if (strcmp(runlevel, RC_LEVEL_SYSINIT) == 0)
 		    return false;
 	if (strcmp(runlevel, RC_LEVEL_SHUTDOWN) == 0 &&
-	    strcmp(type, "iafter") == 0)
+	    type == RC_DT_IAFTER)
 		    return false;
 	if (strcmp(runlevel, bootlevel) != 0) {
 		if (rc_service_in_runlevel(service, bootlevel))
 			return true;
 	}
 
-	state = rc_service_state(service);
-	if (state & RC_SERVICE_HOTPLUGGED ||
-	    state & RC_SERVICE_STARTED)
-		return true;
+	state = service_state(service);
+	valid = (state & RC_SERVICE_HOTPLUGGED ||
+	    state & RC_SERVICE_STARTED);
 
-	return false;
+	if (decisions) {
+		snprintf(decision, sizeof(decision), "valid %d %s %d",
+		    type, service, valid);
+		rc_stringlist_addu(decisions, decision);
+	}
+	return valid;
 }
 
 static bool
-get_provided1(const char *runlevel, RC_STRINGLIST *providers,
-	      RC_DEPTYPE *deptype, const char *level,
-	      bool hotplugged, RC_SERVICE state)
+get_provided1(const RC_DEPTREE *deptree, const char *runlevel,
+	      RC_STRINGLIST *providers, const DT_DEPTYPE *deptype,
+	      const char *level, bool hotplugged, RC_SERVICE state)
 {
-	RC_STRING *service;
 	RC_SERVICE st;
 	bool retval = false;
 	bool ok;
 	const char *svc;
+	uint32_t i;
 
-	TAILQ_FOREACH(service, deptype->services, entries) {
+	for (i = 0; i < deptype->nrefs; i++) {
 		ok = true;
-		svc = service->value;
-		st = rc_service_state(svc);
+		svc = dt_ref(deptree, deptype, i);
+		st = service_state(svc);
 
 		if (level)
 			ok = rc_service_in_runlevel(svc, level);
@@ -272,13 +787,15 @@ get_provided1(const char *runlevel, RC_STRINGLIST *providers,
    provided dependancy can change depending on runlevel state.
    */
 static RC_STRINGLIST *
-get_provided(const RC_DEPINFO *depinfo, const char *runlevel, int options)
+get_provided(const RC_DEPTREE *deptree, const DT_SERVICE *depinfo,
+	     const char *runlevel, int options)
 {
-	RC_DEPTYPE *dt;
+	const DT_DEPTYPE *dt;
 	RC_STRINGLIST *providers = rc_stringlist_new();
-	RC_STRING *service;
+	const char *svc;
+	uint32_t i;
 
-	dt = get_deptype(depinfo, "providedby");
+	dt = dt_deptype(depinfo, RC_DT_PROVIDEDBY);
 	if (!dt)
 		return providers;
 
@@ -286,20 +803,22 @@ get_provided(const RC_DEPINFO *depinfo, const char *runlevel, int options)
 	   This is especially true for net services as they could force a restart
 	   of the local dns resolver which may depend on net. */
 	if (options & RC_DEP_STOP) {
-		TAILQ_FOREACH(service, dt->services, entries)
-			rc_stringlist_add(providers, service->value);
+		for (i = 0; i < dt->nrefs; i++)
+			rc_stringlist_add(providers, dt_ref(deptree, dt, i));
 		return providers;
 	}
 
 	/* If we're strict or starting, then only use what we have in our
 	 * runlevel and bootlevel. If we starting then check hotplugged too. */
 	if (options & RC_DEP_STRICT || options & RC_DEP_START) {
-		TAILQ_FOREACH(service, dt->services, entries)
-			if (rc_service_in_runlevel(service->value, runlevel) ||
-			    rc_service_in_runlevel(service->value, bootlevel) ||
+		for (i = 0; i < dt->nrefs; i++) {
+			svc = dt_ref(deptree, dt, i);
+			if (rc_service_in_runlevel(svc, runlevel) ||
+			    rc_service_in_runlevel(svc, bootlevel) ||
 			    (options & RC_DEP_START &&
-			     rc_service_state(service->value) & RC_SERVICE_HOTPLUGGED))
-				rc_stringlist_add(providers, service->value);
+			     service_state(svc) & RC_SERVICE_HOTPLUGGED))
+				rc_stringlist_add(providers, svc);
+		}
 		if (TAILQ_FIRST(providers))
 			return providers;
 	}
@@ -324,124 +843,294 @@ get_provided(const RC_DEPINFO *depinfo, const char *runlevel, int options)
 	}
 
 	/* Anything running has to come first */
-	if (get_provided1(runlevel, providers, dt, runlevel, false, RC_SERVICE_STARTED))
+	if (get_provided1(deptree, runlevel, providers, dt, runlevel, false, RC_SERVICE_STARTED))
 	{ DO }
-	if (get_provided1(runlevel, providers, dt, NULL, true, RC_SERVICE_STARTED))
+	if (get_provided1(deptree, runlevel, providers, dt, NULL, true, RC_SERVICE_STARTED))
 	{ DO }
 	if (bootlevel && strcmp(runlevel, bootlevel) != 0 &&
-	    get_provided1(runlevel, providers, dt, bootlevel, false, RC_SERVICE_STARTED))
+	    get_provided1(deptree, runlevel, providers, dt, bootlevel, false, RC_SERVICE_STARTED))
 	{ DO }
-	if (get_provided1(runlevel, providers, dt, NULL, false, RC_SERVICE_STARTED))
+	if (get_provided1(deptree, runlevel, providers, dt, NULL, false, RC_SERVICE_STARTED))
 	{ DO }
 
 	/* Check starting services */
-	if (get_provided1(runlevel, providers, dt, runlevel, false, RC_SERVICE_STARTING))
+	if (get_provided1(deptree, runlevel, providers, dt, runlevel, false, RC_SERVICE_STARTING))
 		return providers;
-	if (get_provided1(runlevel, providers, dt, NULL, true, RC_SERVICE_STARTING))
+	if (get_provided1(deptree, runlevel, providers, dt, NULL, true, RC_SERVICE_STARTING))
 		return providers;
 	if (bootlevel && strcmp(runlevel, bootlevel) != 0 &&
-	    get_provided1(runlevel, providers, dt, bootlevel, false, RC_SERVICE_STARTING))
+	    get_provided1(deptree, runlevel, providers, dt, bootlevel, false, RC_SERVICE_STARTING))
 	    return providers;
-	if (get_provided1(runlevel, providers, dt, NULL, false, RC_SERVICE_STARTING))
+	if (get_provided1(deptree, runlevel, providers, dt, NULL, false, RC_SERVICE_STARTING))
 		return providers;
 
 	/* Nothing started then. OK, lets get the stopped services */
-	if (get_provided1(runlevel, providers, dt, runlevel, false, RC_SERVICE_STOPPED))
+	if (get_provided1(deptree, runlevel, providers, dt, runlevel, false, RC_SERVICE_STOPPED))
 		return providers;
-	if (get_provided1(runlevel, providers, dt, NULL, true, RC_SERVICE_STOPPED))
+	if (get_provided1(deptree, runlevel, providers, dt, NULL, true, RC_SERVICE_STOPPED))
 	{ DO }
 	if (bootlevel && (strcmp(runlevel, bootlevel) != 0) &&
-	    get_provided1(runlevel, providers, dt, bootlevel, false, RC_SERVICE_STOPPED))
+	    get_provided1(deptree, runlevel, providers, dt, bootlevel, false, RC_SERVICE_STOPPED))
 		return providers;
 
 	/* Still nothing? OK, list our first provided service. */
-	service = TAILQ_FIRST(dt->services);
-	if (service != NULL)
-		rc_stringlist_add(providers, service->value);
+	if (dt->nrefs != 0)
+		rc_stringlist_add(providers, dt_ref(deptree, dt, 0));
 
 	return providers;
 }
 
-static void
-visit_service(const RC_DEPTREE *deptree,
-	      const RC_STRINGLIST *types,
-	      RC_STRINGLIST *sorted,
-	      RC_STRINGLIST *visited,
-	      const RC_DEPINFO *depinfo,
-	      const char *runlevel, int options)
-{
-	RC_STRING *type;
-	RC_STRING *service;
-	RC_DEPTYPE *dt;
-	RC_DEPINFO *di;
+/* Join a list onto a prefix, space separated */
+static char *
+deporder_join(const char *prefix, const RC_STRINGLIST *list)
+{
+	const RC_STRING *s;
+	char *line, *p;
+	size_t len = strlen(prefix) + 1;
+
+	TAILQ_FOREACH(s, list, entries)
+		len += strlen(s->value) + 1;
+	p = line = xmalloc(len);
+	len = strlen(prefix);
+	memcpy(p, prefix, len);
+	p += len;
+	TAILQ_FOREACH(s, list, entries) {
+		*p++ = ' ';
+		len = strlen(s->value);
+		memcpy(p, s->value, len);
+		p += len;
+	}
+	*p = '\0';
+	return line;
+}
+
+static char *
+provided_decision(const RC_DEPTREE *deptree, const DT_SERVICE *depinfo,
+		  const RC_STRINGLIST *providers)
+{
+	char prefix[PATH_MAX];
+
+	snprintf(prefix, sizeof(prefix), "provided %s",
+	    dt_string(deptree, depinfo->name));
+	return deporder_join(prefix, providers);
+}
+
+/* As get_provided, but note the choice if we're caching the order */
+static RC_STRINGLIST *
+decide_provided(const RC_DEPTREE *deptree, const DT_SERVICE *depinfo,
+		const char *runlevel, int options)
+{
+	RC_STRINGLIST *providers;
+	char *decision;
+
+	providers = get_provided(deptree, depinfo, runlevel, options);
+	if (decisions && dt_deptype(depinfo, RC_DT_PROVIDEDBY)) {
+		decision = provided_decision(deptree, depinfo, providers);
+		rc_stringlist_addu(decisions, decision);
+		free(decision);
+	}
+	return providers;
+}
+
+/* Services we are part way through visiting are kept on an explicit
+ * stack rather than recursing, so long chains don't eat our stack */
+typedef struct depframe {
+	const DT_SERVICE *depinfo;
+	size_t t;
+	uint32_t i;
 	RC_STRINGLIST *provided;
 	RC_STRING *p;
-	const char *svcname;
+} DEPFRAME;
+
+typedef struct depwalk {
+	const RC_DEPTREE *deptree;
+	const RC_DT *types;
+	size_t ntypes;
+	const char *runlevel;
+	int options;
+	RC_STRINGLIST *sorted;
+	RC_STRINGLIST *cycles;
+	RC_STRINGLIST **provided;
+	uint32_t *visited;
+	uint32_t *active;
+	DEPFRAME *stack;
+	size_t depth;
+} DEPWALK;
+
+#define BIT_SET(_b, _i)		((_b)[(_i) / 32] |= 1U << ((_i) % 32))
+#define BIT_CLR(_b, _i)		((_b)[(_i) / 32] &= ~(1U << ((_i) % 32)))
+#define BIT_ISSET(_b, _i)	((_b)[(_i) / 32] & (1U << ((_i) % 32)))
+
+/* Note a loop from the service at the given depth to the top of the
+ * stack. The same loop can be found from any service in it, so we start
+ * it from the lowest name. */
+static void
+walk_cycle(DEPWALK *w, size_t from)
+{
+	const RC_DEPTREE *deptree = w->deptree;
+	const char *name;
+	char *cycle, *p;
+	size_t len = 0, first = from, i, j;
+
+	for (i = from; i < w->depth; i++) {
+		name = dt_string(deptree, w->stack[i].depinfo->name);
+		len += strlen(name) + 1;
+		if (strcmp(name,
+		    dt_string(deptree, w->stack[first].depinfo->name)) < 0)
+			first = i;
+	}
+	p = cycle = xmalloc(len);
+	for (i = 0; i < w->depth - from; i++) {
+		j = from + (first - from + i) % (w->depth - from);
+		name = dt_string(deptree, w->stack[j].depinfo->name);
+		if (p != cycle)
+			*p++ = ' ';
+		len = strlen(name);
+		memcpy(p, name, len);
+		p += len;
+	}
+	*p = '\0';
+	rc_stringlist_addu(w->cycles, cycle);
+	free(cycle);
+}
+
+/* Which services provide another only depends on the state we started
+ * in, so we only work it out once for each service per walk */
+static RC_STRINGLIST *
+walk_provided(DEPWALK *w, const DT_SERVICE *depinfo)
+{
+	uint32_t id = depinfo - w->deptree->services;
+
+	if (!w->provided[id])
+		w->provided[id] = decide_provided(w->deptree, depinfo,
+		    w->runlevel, w->options);
+	else if (dt_deptype(depinfo, RC_DT_PROVIDEDBY))
+		provided_hits++;
+	return w->provided[id];
+}
+
+static void
+walk_enter(DEPWALK *w, const DT_SERVICE *depinfo)
+{
+	DEPFRAME *f;
+	uint32_t id = depinfo - w->deptree->services;
+	size_t i;
 
 	/* Check if we have already visited this service or not */
-	TAILQ_FOREACH(type, visited, entries)
-		if (strcmp(type->value, depinfo->service) == 0)
-			return;
-	/* Add ourselves as a visited service */
-	rc_stringlist_add(visited, depinfo->service);
+	if (BIT_ISSET(w->visited, id)) {
+		if (w->cycles && BIT_ISSET(w->active, id))
+			for (i = 0; i < w->depth; i++)
+				if (w->stack[i].depinfo == depinfo) {
+					walk_cycle(w, i);
+					break;
+				}
+		return;
+	}
+	BIT_SET(w->visited, id);
+	BIT_SET(w->active, id);
 
-	TAILQ_FOREACH(type, types, entries)
-	{
-		if (!(dt = get_deptype(depinfo, type->value)))
-			continue;
+	f = &w->stack[w->depth++];
+	memset(f, 0, sizeof(*f));
+	f->depinfo = depinfo;
+}
+
+/* Find the next service the service we're visiting leads to */
+static const DT_SERVICE *
+walk_next(DEPWALK *w, DEPFRAME *f)
+{
+	const RC_DEPTREE *deptree = w->deptree;
+	const DT_DEPTYPE *dt;
+	const DT_SERVICE *di;
+	const RC_STRING *p;
+	const char *service;
+
+	for (;;) {
+		/* Carry on through the providers of the dependency */
+		while ((p = f->p)) {
+			f->p = TAILQ_NEXT(p, entries);
+			di = dt_service(deptree, p->value);
+			if (di && valid_service(w->runlevel, p->value,
+			    w->types[f->t]))
+				return di;
+		}
+		if (f->provided) {
+			f->provided = NULL;
+			f->i++;
+		}
 
-		TAILQ_FOREACH(service, dt->services, entries) {
-			if (!(options & RC_DEP_TRACE) ||
-			    strcmp(type->value, "iprovide") == 0)
+		if (f->t < w->ntypes) {
+			if (!(dt = dt_deptype(f->depinfo, w->types[f->t])) ||
+			    f->i >= dt->nrefs)
 			{
-				rc_stringlist_add(sorted, service->value);
+				f->t++;
+				f->i = 0;
 				continue;
 			}
-
-			if (!(di = get_depinfo(deptree, service->value)))
+			service = dt_ref(deptree, dt, f->i);
+			if (!(w->options & RC_DEP_TRACE) ||
+			    w->types[f->t] == RC_DT_IPROVIDE)
+			{
+				rc_stringlist_add(w->sorted, service);
+				f->i++;
 				continue;
-			provided = get_provided(di, runlevel, options);
-
-			if (TAILQ_FIRST(provided)) {
-				TAILQ_FOREACH(p, provided, entries) {
-					di = get_depinfo(deptree, p->value);
-					if (di && valid_service(runlevel, di->service, type->value))
-						visit_service(deptree, types, sorted, visited, di,
-							      runlevel, options | RC_DEP_TRACE);
-				}
 			}
-			else if (di && valid_service(runlevel, service->value, type->value))
-				visit_service(deptree, types, sorted, visited, di,
-					      runlevel, options | RC_DEP_TRACE);
-
-			rc_stringlist_free(provided);
+			if (!(di = dt_service(deptree, service))) {
+				f->i++;
+				continue;
+			}
+			f->provided = walk_provided(w, di);
+			if ((f->p = TAILQ_FIRST(f->provided)))
+				continue;
+			f->provided = NULL;
+			f->i++;
+			if (valid_service(w->runlevel, service, w->types[f->t]))
+				return di;
+			continue;
 		}
-	}
 
-	/* Now visit the stuff we provide for */
-	if (options & RC_DEP_TRACE &&
-	    (dt = get_deptype(depinfo, "iprovide")))
-	{
-		TAILQ_FOREACH(service, dt->services, entries) {
-			if (!(di = get_depinfo(deptree, service->value)))
+		/* Now visit the stuff we provide for */
+		if (f->t == w->ntypes && w->options & RC_DEP_TRACE &&
+		    (dt = dt_deptype(f->depinfo, RC_DT_IPROVIDE)) &&
+		    f->i < dt->nrefs)
+		{
+			service = dt_ref(deptree, dt, f->i++);
+			if (!(di = dt_service(deptree, service)))
 				continue;
-			provided = get_provided(di, runlevel, options);
-			TAILQ_FOREACH(p, provided, entries)
-				if (strcmp(p->value, depinfo->service) == 0) {
-					visit_service(deptree, types, sorted, visited, di,
-						       runlevel, options | RC_DEP_TRACE);
-					break;
-				}
-			rc_stringlist_free(provided);
+			if (rc_stringlist_find(walk_provided(w, di),
+			    dt_string(deptree, f->depinfo->name)))
+				return di;
+			continue;
 		}
+		f->t = w->ntypes + 1;
+		return NULL;
 	}
+}
 
-	/* We've visited everything we need, so add ourselves unless we
-	   are also the service calling us or we are provided by something */
-	svcname = getenv("RC_SVCNAME");
-	if (!svcname || strcmp(svcname, depinfo->service) != 0) {
-		if (!get_deptype(depinfo, "providedby"))
-			rc_stringlist_add(sorted, depinfo->service);
+static void
+visit_service(DEPWALK *w, const DT_SERVICE *depinfo)
+{
+	DEPFRAME *f;
+	const DT_SERVICE *di;
+	const char *svcname = getenv("RC_SVCNAME");
+	const char *name;
+
+	walk_enter(w, depinfo);
+	while (w->depth) {
+		f = &w->stack[w->depth - 1];
+		if ((di = walk_next(w, f))) {
+			walk_enter(w, di);
+			continue;
+		}
+
+		/* We've visited everything we need, so add ourselves unless we
+		   are also the service calling us or we are provided by something */
+		name = dt_string(w->deptree, f->depinfo->name);
+		if (!svcname || strcmp(svcname, name) != 0) {
+			if (!dt_deptype(f->depinfo, RC_DT_PROVIDEDBY))
+				rc_stringlist_add(w->sorted, name);
+		}
+		BIT_CLR(w->active, f->depinfo - w->deptree->services);
+		w->depth--;
 	}
 }
 
@@ -449,94 +1138,277 @@ RC_STRINGLIST *
 rc_deptree_depend(const RC_DEPTREE *deptree,
 		  const char *service, const char *type)
 {
-	RC_DEPINFO *di;
-	RC_DEPTYPE *dt;
+	const DT_SERVICE *di;
+	const DT_DEPTYPE *dt;
 	RC_STRINGLIST *svcs;
-	RC_STRING *svc;
+	uint32_t i;
+	int t;
 
 	svcs = rc_stringlist_new();
-	if (!(di = get_depinfo(deptree, service)) ||
-	    !(dt = get_deptype(di, type)))
+	if ((t = deptype_intern(type)) == -1 ||
+	    !(di = dt_service(deptree, service)) ||
+	    !(dt = dt_deptype(di, t)))
 	{
 		errno = ENOENT;
 		return svcs;
 	}
 
 	/* For consistency, we copy the array */
-	TAILQ_FOREACH(svc, dt->services, entries)
-		rc_stringlist_add(svcs, svc->value);
+	for (i = 0; i < dt->nrefs; i++)
+		rc_stringlist_add(svcs, dt_ref(deptree, dt, i));
 	return svcs;
 }
 librc_hidden_def(rc_deptree_depend)
 
-RC_STRINGLIST *
-rc_deptree_depends(const RC_DEPTREE *deptree,
-		   const RC_STRINGLIST *types,
-		   const RC_STRINGLIST *services,
-		   const char *runlevel, int options)
+static RC_STRINGLIST *
+deptree_walk(const RC_DEPTREE *deptree,
+	     const RC_STRINGLIST *types,
+	     const RC_STRINGLIST *services,
+	     const char *runlevel, int options,
+	     RC_STRINGLIST *cycles)
 {
-	RC_STRINGLIST *sorted = rc_stringlist_new();
-	RC_STRINGLIST *visited = rc_stringlist_new();
-	RC_DEPINFO *di;
+	DEPWALK w;
+	const DT_SERVICE *di;
 	const RC_STRING *service;
+	RC_DT *typeids = NULL;
+	size_t ntypes = 0, nwords;
+	uint32_t i;
+	int t;
+	bool snapshot = !states;
 
 	bootlevel = getenv("RC_BOOTLEVEL");
 	if (!bootlevel)
 		bootlevel = RC_LEVEL_BOOT;
+
+	/* Intern the types once rather than for every service we visit */
+	if (types) {
+		TAILQ_FOREACH(service, types, entries)
+			ntypes++;
+		typeids = xmalloc(sizeof(*typeids) * (ntypes + 1));
+		ntypes = 0;
+		TAILQ_FOREACH(service, types, entries)
+			if ((t = deptype_intern(service->value)) != -1)
+				typeids[ntypes++] = t;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.deptree = deptree;
+	w.types = typeids;
+	w.ntypes = ntypes;
+	w.runlevel = runlevel;
+	w.options = options;
+	w.sorted = rc_stringlist_new();
+	w.cycles = cycles;
+	/* Each service is on the stack at most once */
+	nwords = deptree->header->nservices / 32 + 1;
+	w.visited = xmalloc(sizeof(*w.visited) * nwords * 2);
+	memset(w.visited, 0, sizeof(*w.visited) * nwords * 2);
+	w.active = w.visited + nwords;
+	w.stack = xmalloc(sizeof(*w.stack) * (deptree->header->nservices + 1));
+	w.provided = xmalloc(sizeof(*w.provided) *
+	    (deptree->header->nservices + 1));
+	memset(w.provided, 0, sizeof(*w.provided) *
+	    (deptree->header->nservices + 1));
+
 	TAILQ_FOREACH(service, services, entries) {
-		if (!(di = get_depinfo(deptree, service->value))) {
+		if (!(di = dt_service(deptree, service->value))) {
 			errno = ENOENT;
 			continue;
 		}
 		if (types)
-			visit_service(deptree, types, sorted, visited,
-				      di, runlevel, options);
+			visit_service(&w, di);
 	}
-	rc_stringlist_free(visited);
-	return sorted;
+	for (i = 0; i < deptree->header->nservices; i++)
+		rc_stringlist_free(w.provided[i]);
+	free(w.provided);
+	free(w.stack);
+	free(w.visited);
+	free(typeids);
+	if (snapshot) {
+		rc_service_states_free(states);
+		states = NULL;
+	}
+	return w.sorted;
 }
-librc_hidden_def(rc_deptree_depends)
 
 RC_STRINGLIST *
-rc_deptree_order(const RC_DEPTREE *deptree, const char *runlevel, int options)
+rc_deptree_depends(const RC_DEPTREE *deptree,
+		   const RC_STRINGLIST *types,
+		   const RC_STRINGLIST *services,
+		   const char *runlevel, int options)
 {
-	RC_STRINGLIST *list;
-	RC_STRINGLIST *list2;
-	RC_STRINGLIST *types;
-	RC_STRINGLIST *services;
+	return deptree_walk(deptree, types, services, runlevel, options, NULL);
+}
+librc_hidden_def(rc_deptree_depends)
 
-	bootlevel = getenv("RC_BOOTLEVEL");
-	if (! bootlevel)
-		bootlevel = RC_LEVEL_BOOT;
+unsigned long
+rc_deptree_provided_hits(void)
+{
+	return provided_hits;
+}
+librc_hidden_def(rc_deptree_provided_hits)
 
-	/* When shutting down, list all running services */
-	if (strcmp(runlevel, RC_LEVEL_SINGLE) == 0 ||
-	    strcmp(runlevel, RC_LEVEL_SHUTDOWN) == 0)
-	{
-		list = rc_services_in_state(RC_SERVICE_STARTED);
-		list2 = rc_services_in_state(RC_SERVICE_INACTIVE);
-		TAILQ_CONCAT(list, list2, entries);
-		free(list2);
-		list2 = rc_services_in_state(RC_SERVICE_STARTING);
-		TAILQ_CONCAT(list, list2, entries);
-		free(list2);
-	} else {
-		list = rc_services_in_runlevel(RC_LEVEL_SYSINIT);
-		if (strcmp(runlevel, RC_LEVEL_SYSINIT) != 0) {
-			list2 = rc_services_in_runlevel(runlevel);
-			TAILQ_CONCAT(list, list2, entries);
-			free(list2);
-			list2 = rc_services_in_state(RC_SERVICE_HOTPLUGGED);
-			TAILQ_CONCAT(list, list2, entries);
-			free(list2);
-			/* If we're not the boot runlevel then add that too */
-			if (strcmp(runlevel, bootlevel) != 0) {
-				list2 = rc_services_in_runlevel(bootlevel);
-				TAILQ_CONCAT(list, list2, entries);
-				free(list2);
+RC_STRINGLIST *
+rc_deptree_cycles(const RC_DEPTREE *deptree,
+		  const RC_STRINGLIST *types,
+		  const RC_STRINGLIST *services,
+		  const char *runlevel, int options)
+{
+	RC_STRINGLIST *cycles = rc_stringlist_new();
+
+	rc_stringlist_free(deptree_walk(deptree, types, services,
+	    runlevel, options, cycles));
+	return cycles;
+}
+librc_hidden_def(rc_deptree_cycles)
+
+/* Add services to the list we order, noting where they came from in
+ * the cache key */
+static void
+deporder_input(RC_STRINGLIST *list, RC_STRINGLIST *key,
+	       const char *what, const char *name, RC_STRINGLIST *services)
+{
+	char prefix[PATH_MAX];
+	char *line;
+
+	snprintf(prefix, sizeof(prefix), "%s %s", what, name);
+	line = deporder_join(prefix, services);
+	rc_stringlist_addu(key, line);
+	free(line);
+	if (list)
+		TAILQ_CONCAT(list, services, entries);
+	rc_stringlist_free(services);
+}
+
+/* A cached order is only good if it was made from the same key, and the
+ * choices it made from service state would still be made now */
+static RC_STRINGLIST *
+deporder_load(const char *file, const RC_STRINGLIST *key,
+	      const RC_DEPTREE *deptree, const char *runlevel, int options)
+{
+	FILE *fp;
+	RC_STRINGLIST *services = NULL;
+	RC_STRINGLIST *provided;
+	const RC_STRING *k;
+	const DT_SERVICE *di;
+	char *line = NULL;
+	char *decision;
+	char *p;
+	char *service;
+	char name[PATH_MAX];
+	size_t len = 0;
+	long type;
+	bool ok = true;
+
+	if (!(fp = fopen(file, "r")))
+		return NULL;
+	k = TAILQ_FIRST(key);
+	while (ok && !services && (rc_getline(&line, &len, fp))) {
+		if (k) {
+			ok = strcmp(line, k->value) == 0;
+			k = TAILQ_NEXT(k, entries);
+		} else if (strncmp(line, "provided ", 9) == 0) {
+			snprintf(name, sizeof(name), "%.*s",
+			    (int)strcspn(line + 9, " "), line + 9);
+			if (!(di = dt_service(deptree, name))) {
+				ok = false;
+				continue;
 			}
-		}
+			provided = get_provided(deptree, di, runlevel, options);
+			decision = provided_decision(deptree, di, provided);
+			ok = strcmp(decision, line) == 0;
+			free(decision);
+			rc_stringlist_free(provided);
+		} else if (strncmp(line, "valid ", 6) == 0) {
+			type = strtol(line + 6, &p, 10);
+			if (*p == ' ')
+				p++;
+			service = strsep(&p, " ");
+			ok = type >= 0 && type < RC_DT_MAX &&
+			    p && (*p == '0' || *p == '1') &&
+			    valid_service(runlevel, service, type) == (*p == '1');
+		} else if (strcmp(line, "order") == 0)
+			services = rc_stringlist_new();
+		else if (strncmp(line, "order ", 6) == 0)
+			services = rc_stringlist_split(line + 6, " ");
+		else
+			ok = false;
 	}
+	fclose(fp);
+	free(line);
+
+	if (services && k) {
+		rc_stringlist_free(services);
+		services = NULL;
+	}
+	return services;
+}
+
+static void
+deporder_save(const char *file, const RC_STRINGLIST *key,
+	      const RC_STRINGLIST *choices, const RC_STRINGLIST *services)
+{
+	RC_STRING *s;
+	FILE *fp;
+	char tmp[PATH_MAX];
+	char *order;
+
+	if (!(fp = save_open(file, tmp, sizeof(tmp))))
+		return;
+	TAILQ_FOREACH(s, key, entries)
+		fprintf(fp, "%s\n", s->value);
+	TAILQ_FOREACH(s, choices, entries)
+		fprintf(fp, "%s\n", s->value);
+	order = deporder_join("order", services);
+	fprintf(fp, "%s\n", order);
+	free(order);
+	save_close(fp, tmp, file, true);
+}
+
+/* Start the cache key for an order, with what the order depends on
+ * besides the services it starts from */
+static RC_STRINGLIST *
+deporder_key(const RC_DEPTREE *deptree, const char *runlevel, int options)
+{
+	RC_STRINGLIST *key;
+	const char *svcname;
+	char line[PATH_MAX];
+
+	/* The order is cached against the deptree and the services in the
+	 * runlevels we look at, rather than their mtimes which are too coarse
+	 * to notice rc-update being run twice in a second */
+	svcname = getenv("RC_SVCNAME");
+	key = rc_stringlist_new();
+	rc_stringlist_add(key, RC_DEPORDER_MAGIC);
+	snprintf(line, sizeof(line), "key %s %d %s %s %u %08x",
+	    runlevel, options, bootlevel, svcname ? svcname : "-",
+	    deptree->header->size, deptree->header->sum);
+	rc_stringlist_add(key, line);
+	return key;
+}
+
+/* Order list by what its services need, use and come after, reusing the
+ * order in file if it was made from the same key */
+static RC_STRINGLIST *
+deporder_get(const RC_DEPTREE *deptree, const RC_STRINGLIST *list,
+	     const RC_STRINGLIST *key, const char *name,
+	     const char *runlevel, int options)
+{
+	RC_STRINGLIST *types;
+	RC_STRINGLIST *services;
+	char file[PATH_MAX];
+	bool cache;
+	bool snapshot = !states;
+
+	/* Only the providedby choices and any service state we checked need
+	 * to be resolved again to reuse the order from last time */
+	cache = !strchr(runlevel, '/');
+	snprintf(file, sizeof(file), RC_DEPORDERDIR "/%s.%d%s",
+	    runlevel, options, name);
+	if (cache &&
+	    (services = deporder_load(file, key, deptree, runlevel,
+		RC_DEP_STRICT | RC_DEP_TRACE | options)))
+		goto out;
 
 	/* Now we have our lists, we need to pull in any dependencies
 	   and order them */
@@ -544,34 +1416,139 @@ rc_deptree_order(const RC_DEPTREE *deptree, const char *runlevel, int options)
 	rc_stringlist_add(types, "ineed");
 	rc_stringlist_add(types, "iuse");
 	rc_stringlist_add(types, "iafter");
+	if (cache)
+		decisions = rc_stringlist_new();
 	services = rc_deptree_depends(deptree, types, list, runlevel,
 				      RC_DEP_STRICT | RC_DEP_TRACE | options);
-	rc_stringlist_free(list);
+	if (decisions) {
+		deporder_save(file, key, decisions, services);
+		rc_stringlist_free(decisions);
+		decisions = NULL;
+	}
 	rc_stringlist_free(types);
+
+out:
+	if (snapshot) {
+		rc_service_states_free(states);
+		states = NULL;
+	}
+	return services;
+}
+
+RC_STRINGLIST *
+rc_deptree_order(const RC_DEPTREE *deptree, const char *runlevel, int options)
+{
+	RC_STRINGLIST *list;
+	RC_STRINGLIST *key;
+	RC_STRINGLIST *services;
+
+	bootlevel = getenv("RC_BOOTLEVEL");
+	if (! bootlevel)
+		bootlevel = RC_LEVEL_BOOT;
+
+	key = deporder_key(deptree, runlevel, options);
+	list = rc_stringlist_new();
+	/* When shutting down, list all running services */
+	if (strcmp(runlevel, RC_LEVEL_SINGLE) == 0 ||
+	    strcmp(runlevel, RC_LEVEL_SHUTDOWN) == 0)
+	{
+		deporder_input(list, key, "state", "started",
+		    rc_services_in_state(RC_SERVICE_STARTED));
+		deporder_input(list, key, "state", "inactive",
+		    rc_services_in_state(RC_SERVICE_INACTIVE));
+		deporder_input(list, key, "state", "starting",
+		    rc_services_in_state(RC_SERVICE_STARTING));
+		deporder_input(NULL, key, "level", runlevel,
+		    rc_services_in_runlevel(runlevel));
+		deporder_input(NULL, key, "level", bootlevel,
+		    rc_services_in_runlevel(bootlevel));
+	} else {
+		deporder_input(list, key, "level", RC_LEVEL_SYSINIT,
+		    rc_services_in_runlevel(RC_LEVEL_SYSINIT));
+		if (strcmp(runlevel, RC_LEVEL_SYSINIT) != 0) {
+			deporder_input(list, key, "level", runlevel,
+			    rc_services_in_runlevel(runlevel));
+			deporder_input(list, key, "state", "hotplugged",
+			    rc_services_in_state(RC_SERVICE_HOTPLUGGED));
+			/* If we're not the boot runlevel then add that too */
+			if (strcmp(runlevel, bootlevel) != 0)
+				deporder_input(list, key, "level", bootlevel,
+				    rc_services_in_runlevel(bootlevel));
+		} else
+			deporder_input(NULL, key, "level", bootlevel,
+			    rc_services_in_runlevel(bootlevel));
+	}
+
+	services = deporder_get(deptree, list, key, "", runlevel, options);
+	rc_stringlist_free(list);
+	rc_stringlist_free(key);
 	return services;
 }
 librc_hidden_def(rc_deptree_order)
 
+RC_STRINGLIST *
+rc_deptree_order_runlevel(const RC_DEPTREE *deptree, const char *runlevel,
+			  int options)
+{
+	RC_STRINGLIST *list;
+	RC_STRINGLIST *key;
+	RC_STRINGLIST *services;
+
+	bootlevel = getenv("RC_BOOTLEVEL");
+	if (! bootlevel)
+		bootlevel = RC_LEVEL_BOOT;
+
+	key = deporder_key(deptree, runlevel, options);
+	list = rc_stringlist_new();
+	services = rc_services_in_runlevel(runlevel);
+	rc_stringlist_sort(&services);
+	deporder_input(list, key, "level", runlevel, services);
+	services = deporder_get(deptree, list, key, ".level", runlevel, options);
+	rc_stringlist_free(list);
+	rc_stringlist_free(key);
+	return services;
+}
+librc_hidden_def(rc_deptree_order_runlevel)
+
+/* Record what a file looked like so we can tell if it changes */
+static void
+manifest_add(RC_STRINGLIST *manifest, const struct stat *st,
+	     const char *path)
+{
+	char entry[PATH_MAX + 64];
+
+	if (!manifest)
+		return;
+	if (st)
+		snprintf(entry, sizeof(entry), "%c %lld %ld %lld %s",
+		    S_ISDIR(st->st_mode) ? 'd' : 'f',
+		    (long long)st->st_mtime, MTIME_NSEC(st),
+		    (long long)st->st_size, path);
+	else
+		snprintf(entry, sizeof(entry), "- 0 0 0 %s", path);
+	rc_stringlist_add(manifest, entry);
+}
+
+/* Compare the mtime of name, relative to dfd, and of everything under it
+ * against mtime. path is a PATH_MAX buffer holding the full name, which we
+ * extend as we descend. */
 static bool
-mtime_check(const char *source, const char *target, bool newer,
-	    time_t *rel, char *file)
+mtime_walk(int dfd, const char *name, char *path, time_t mtime,
+	   bool newer, time_t *rel, char *file, RC_STRINGLIST *manifest)
 {
 	struct stat buf;
-	time_t mtime;
 	bool retval = true;
 	DIR *dp;
 	struct dirent *d;
-	char path[PATH_MAX];
-	int serrno = errno;
-
-	/* We have to exist */
-	if (stat(source, &buf) != 0)
-		return false;
-	mtime = buf.st_mtime;
+	size_t len;
+	int fd;
 
 	/* If target does not exist, return true to mimic shell test */
-	if (stat(target, &buf) != 0)
+	if (fstatat(dfd, name, &buf, 0) != 0) {
+		manifest_add(manifest, NULL, path);
 		return true;
+	}
+	manifest_add(manifest, &buf, path);
 
 	if (newer) {
 		if (mtime < buf.st_mtime) {
@@ -582,7 +1559,7 @@ mtime_check(const char *source, const char *target, bool newer,
 		if (rel != NULL) {
 			if (*rel < buf.st_mtime) {
 				if (file)
-					strlcpy(file, target, PATH_MAX);
+					strlcpy(file, path, PATH_MAX);
 				*rel = buf.st_mtime;
 			}
 		}
@@ -595,33 +1572,60 @@ mtime_check(const char *source, const char *target, bool newer,
 		if (rel != NULL) {
 			if (*rel > buf.st_mtime) {
 				if (file)
-					strlcpy(file, target, PATH_MAX);
+					strlcpy(file, path, PATH_MAX);
 				*rel = buf.st_mtime;
 			}
 		}
 	}
 
-	/* If not a dir then reset errno */
-	if (!(dp = opendir(target))) {
-		errno = serrno;
+	if (!S_ISDIR(buf.st_mode))
+		return retval;
+	if ((fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return retval;
+	if (!(dp = fdopendir(fd))) {
+		close(fd);
 		return retval;
 	}
 
 	/* Check all the entries in the dir */
+	len = strlen(path);
 	while ((d = readdir(dp))) {
 		if (d->d_name[0] == '.')
 			continue;
-		snprintf(path, sizeof(path), "%s/%s", target, d->d_name);
-		if (!mtime_check(source, path, newer, rel, file)) {
+		snprintf(path + len, PATH_MAX - len, "/%s", d->d_name);
+		if (!mtime_walk(dirfd(dp), d->d_name, path, mtime,
+			newer, rel, file, manifest))
+		{
 			retval = false;
 			if (rel == NULL)
 				break;
 		}
 	}
+	path[len] = '\0';
 	closedir(dp);
 	return retval;
 }
 
+static bool
+mtime_check(const char *source, const char *target, bool newer,
+	    time_t *rel, char *file)
+{
+	struct stat buf;
+	char path[PATH_MAX];
+	bool retval;
+	int serrno = errno;
+
+	/* We have to exist */
+	if (stat(source, &buf) != 0)
+		return false;
+
+	strlcpy(path, target, sizeof(path));
+	retval = mtime_walk(AT_FDCWD, target, path, buf.st_mtime,
+	    newer, rel, file, NULL);
+	errno = serrno;
+	return retval;
+}
+
 bool
 rc_newer_than(const char *source, const char *target,
 	      time_t *newest, char *file)
@@ -641,17 +1645,23 @@ librc_hidden_def(rc_older_than)
 
 typedef struct deppair
 {
-	const char *depend;
-	const char *addto;
+	RC_DT depend;
+	RC_DT addto;
 } DEPPAIR;
 
 static const DEPPAIR deppairs[] = {
-	{ "ineed",	"needsme" },
-	{ "iuse",	"usesme" },
-	{ "iafter",	"ibefore" },
-	{ "ibefore",	"iafter" },
-	{ "iprovide",	"providedby" },
-	{ NULL, NULL }
+	{ RC_DT_INEED,		RC_DT_NEEDSME },
+	{ RC_DT_IUSE,		RC_DT_USESME },
+	{ RC_DT_IAFTER,		RC_DT_IBEFORE },
+	{ RC_DT_IBEFORE,	RC_DT_IAFTER },
+	{ RC_DT_IPROVIDE,	RC_DT_PROVIDEDBY },
+};
+
+/* Types we need to be started after */
+static const RC_DT afters[] = {
+	RC_DT_INEED,
+	RC_DT_IUSE,
+	RC_DT_IAFTER,
 };
 
 static const char *const depdirs[] =
@@ -669,16 +1679,162 @@ static const char *const depdirs[] =
 	RC_SVCDIR "/exclusive",
 	RC_SVCDIR "/scheduled",
 	RC_SVCDIR "/tmp",
+	RC_DEPORDERDIR,
+	NULL
+};
+
+/* Everything the deptree is generated from, besides the config files
+ * the init scripts tell us about */
+static const char *const depinputs[] =
+{
+	RC_INITDIR,
+	RC_CONFDIR,
+#ifdef RC_PKG_INITDIR
+	RC_PKG_INITDIR,
+#endif
+#ifdef RC_PKG_CONFDIR
+	RC_PKG_CONFDIR,
+#endif
+#ifdef RC_LOCAL_INITDIR
+	RC_LOCAL_INITDIR,
+#endif
+#ifdef RC_LOCAL_CONFDIR
+	RC_LOCAL_CONFDIR,
+#endif
+	RC_CONF,
+	/* So RC_SHLIB is rebuilt when any of these change */
+	RC_LIBEXECDIR "/sh/functions.sh",
+	RC_LIBEXECDIR "/sh/rc-functions.sh",
+	RC_LIBEXECDIR "/sh/rc-cgroup.sh",
+	RC_LIVECD_SHLIB,
 	NULL
 };
 
+static void
+manifest_header(char *header, size_t len, const struct stat *tree)
+{
+	snprintf(header, len, "%s %lld %lld", RC_DEPMANIFEST_MAGIC,
+	    (long long)tree->st_mtime, (long long)tree->st_size);
+}
+
+/* Check every file we saw the last time we found the deptree was current
+ * still looks the same. Each one costs a single fstatat relative to its
+ * directory, and we don't need to read any directories.
+ * Like mtime_walk, we note the newest file in newest and file. */
+static bool
+manifest_check(const struct stat *tree, time_t *newest, char *file)
+{
+	struct stat st;
+	char *buf, *next, *line, *path, *base, *p;
+	char header[64], dir[PATH_MAX];
+	ssize_t r;
+	size_t len = 0;
+	long long mtime, size;
+	long nsec;
+	int fd;
+	bool fresh = false, exists;
+
+	/* We read this on every deptree load, so slurp it in one go rather
+	 * than a line at a time */
+	if ((fd = open(RC_DEPMANIFEST, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	buf = xmalloc(st.st_size + 1);
+	while (len < (size_t)st.st_size) {
+		r = read(fd, buf + len, st.st_size - len);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		len += r;
+	}
+	close(fd);
+	buf[len] = '\0';
+
+	next = buf;
+	line = strsep(&next, "\n");
+	manifest_header(header, sizeof(header), tree);
+	if (!next || strcmp(line, header) != 0)
+		goto out;
+
+	*dir = '\0';
+	fd = -1;
+	fresh = true;
+	while (fresh && next && *next) {
+		line = strsep(&next, "\n");
+		p = line + 1;
+		mtime = strtoll(p, &p, 10);
+		nsec = strtol(p, &p, 10);
+		size = strtoll(p, &p, 10);
+		if (*p++ != ' ' || *p != '/' || !(base = strrchr(p, '/'))) {
+			fresh = false;
+			break;
+		}
+		path = p;
+
+		/* Entries are grouped by directory, so we only open each
+		 * one once */
+		*base = '\0';
+		if (strcmp(path, dir) != 0) {
+			if (fd != -1)
+				close(fd);
+			fd = open(*path ? path : "/",
+			    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			strlcpy(dir, path, sizeof(dir));
+		}
+		exists = fd != -1 && fstatat(fd, base + 1, &st, 0) == 0;
+
+		if (*line == '-')
+			fresh = !exists;
+		else
+			fresh = exists &&
+			    st.st_mtime == mtime &&
+			    MTIME_NSEC(&st) == nsec &&
+			    st.st_size == size &&
+			    S_ISDIR(st.st_mode) == (*line == 'd');
+		if (fresh && *line != '-' && newest && *newest < mtime) {
+			*newest = mtime;
+			if (file)
+				snprintf(file, PATH_MAX, "%s/%s",
+				    dir, base + 1);
+		}
+	}
+	if (fd != -1)
+		close(fd);
+
+out:
+	free(buf);
+	return fresh;
+}
+
+static void
+manifest_save(const struct stat *tree, const RC_STRINGLIST *manifest)
+{
+	RC_STRING *s;
+	FILE *fp;
+	char header[64], tmp[PATH_MAX];
+
+	if (!(fp = save_open(RC_DEPMANIFEST, tmp, sizeof(tmp))))
+		return;
+	manifest_header(header, sizeof(header), tree);
+	fprintf(fp, "%s\n", header);
+	TAILQ_FOREACH(s, manifest, entries)
+		fprintf(fp, "%s\n", s->value);
+	save_close(fp, tmp, RC_DEPMANIFEST, true);
+}
+
 bool
 rc_deptree_update_needed(time_t *newest, char *file)
 {
 	bool newer = false;
-	RC_STRINGLIST *config;
+	RC_STRINGLIST *config, *manifest;
 	RC_STRING *s;
-	int i;
+	struct stat tree;
+	char path[PATH_MAX];
+	int i, serrno;
 
 	/* Create base directories if needed */
 	for (i = 0; depdirs[i]; i++)
@@ -687,45 +1843,657 @@ rc_deptree_update_needed(time_t *newest, char *file)
 
 	/* Quick test to see if anything we use has changed and we have
 	 * data in our deptree */
-	if (!existss(RC_DEPTREE_CACHE))
-		return true;
-	if (!rc_newer_than(RC_DEPTREE_CACHE, RC_INITDIR, newest, file))
-		return true;
-	if (!rc_newer_than(RC_DEPTREE_CACHE, RC_CONFDIR, newest, file))
-		return true;
-#ifdef RC_PKG_INITDIR
-	if (!rc_newer_than(RC_DEPTREE_CACHE, RC_PKG_INITDIR, newest, file))
-		return true;
-#endif
-#ifdef RC_PKG_CONFDIR
-	if (!rc_newer_than(RC_DEPTREE_CACHE, RC_PKG_CONFDIR, newest, file))
-		return true;
-#endif
-#ifdef RC_LOCAL_INITDIR
-	if (!rc_newer_than(RC_DEPTREE_CACHE, RC_LOCAL_INITDIR, newest, file))
-		return true;
-#endif
-#ifdef RC_LOCAL_CONFDIR
-	if (!rc_newer_than(RC_DEPTREE_CACHE, RC_LOCAL_CONFDIR, newest, file))
-		return true;
-#endif
-	if (!rc_newer_than(RC_DEPTREE_CACHE, RC_CONF, newest, file))
+	if (stat(RC_DEPTREE_CACHE, &tree) != 0 || tree.st_size == 0)
 		return true;
+	if (manifest_check(&tree, newest, file))
+		return false;
+
+	serrno = errno;
+	manifest = rc_stringlist_new();
+	for (i = 0; depinputs[i] && !newer; i++) {
+		strlcpy(path, depinputs[i], sizeof(path));
+		newer = !mtime_walk(AT_FDCWD, depinputs[i], path, tree.st_mtime,
+		    true, newest, file, manifest);
+	}
 
 	/* Some init scripts dependencies change depending on config files
 	 * outside of baselayout, like syslog-ng, so we check those too. */
-	config = rc_config_list(RC_DEPCONFIG);
-	TAILQ_FOREACH(s, config, entries) {
-		if (!rc_newer_than(RC_DEPTREE_CACHE, s->value, newest, file)) {
-			newer = true;
-			break;
+	if (!newer) {
+		config = rc_config_list(RC_DEPCONFIG);
+		TAILQ_FOREACH(s, config, entries) {
+			strlcpy(path, s->value, sizeof(path));
+			if (!mtime_walk(AT_FDCWD, s->value, path, tree.st_mtime,
+				true, newest, file, manifest))
+			{
+				newer = true;
+				break;
+			}
 		}
+		rc_stringlist_free(config);
 	}
-	rc_stringlist_free(config);
+
+	/* Remember what everything looked like so next time we only
+	 * have to check nothing changed */
+	if (!newer)
+		manifest_save(&tree, manifest);
+	rc_stringlist_free(manifest);
+	errno = serrno;
 	return newer;
 }
 librc_hidden_def(rc_deptree_update_needed)
 
+#define RC_DEPRAW_MAGIC	"RCraw 2"
+
+/* What one init script printed when sourced and the files it read to do so.
+ * We keep these in RC_DEPTREE_RAW so the next update only has to source
+ * the scripts where one of those files has changed. */
+typedef struct depraw {
+	char *path;
+	unsigned long seq;
+	bool fresh;
+	RC_STRINGLIST *inputs;
+	RC_STRINGLIST *lines;
+	TAILQ_ENTRY(depraw) entries;
+} DEPRAW;
+typedef TAILQ_HEAD(depraws, depraw) DEPRAWS;
+
+typedef struct gendep_worker {
+	pid_t pid;
+	int fd;
+	char *buf;
+	size_t len;
+	size_t size;
+} GENDEP_WORKER;
+
+static DEPRAW *
+depraw_new(const char *path)
+{
+	DEPRAW *raw = xmalloc(sizeof(*raw));
+
+	raw->path = path ? xstrdup(path) : NULL;
+	raw->seq = 0;
+	raw->fresh = false;
+	raw->inputs = rc_stringlist_new();
+	raw->lines = rc_stringlist_new();
+	return raw;
+}
+
+static void
+depraw_free(DEPRAW *raw)
+{
+	free(raw->path);
+	rc_stringlist_free(raw->inputs);
+	rc_stringlist_free(raw->lines);
+	free(raw);
+}
+
+static void
+depraws_free(DEPRAWS *raws)
+{
+	DEPRAW *raw;
+
+	if (!raws)
+		return;
+	while ((raw = TAILQ_FIRST(raws))) {
+		TAILQ_REMOVE(raws, raw, entries);
+		depraw_free(raw);
+	}
+	free(raws);
+}
+
+/* Describe a file well enough to tell when it changes or appears */
+static void
+depraw_input(RC_STRINGLIST *inputs, const char *path)
+{
+	struct stat st;
+	char input[PATH_MAX + 64];
+
+	if (stat(path, &st) == -1)
+		memset(&st, 0, sizeof(st));
+	snprintf(input, sizeof(input), "file %lld %ld %lld %llu %s",
+	    (long long)st.st_mtime, MTIME_NSEC(&st), (long long)st.st_size,
+	    (unsigned long long)st.st_ino, path);
+	rc_stringlist_addu(inputs, input);
+}
+
+/* Describe the names in a directory, which a depend function sees if it
+ * uses a glob. Unlike the mtime of the directory this does not change
+ * when a script is replaced, which is what package managers do. */
+static void
+depraw_listing(RC_STRINGLIST *inputs, const char *path)
+{
+	DIR *dp;
+	struct dirent *d;
+	uint32_t sum = 0, x = 0;
+	unsigned long count = 0;
+	char input[PATH_MAX + 64];
+
+	if ((dp = opendir(path))) {
+		while ((d = readdir(dp))) {
+			if (d->d_name[0] == '.')
+				continue;
+			sum += hash_service(d->d_name);
+			x ^= hash_service(d->d_name) * 31;
+			count++;
+		}
+		closedir(dp);
+	}
+	snprintf(input, sizeof(input), "dir %lu %08x%08x %s",
+	    count, sum, x, path);
+	rc_stringlist_addu(inputs, input);
+}
+
+/* Files every script reads */
+static RC_STRINGLIST *
+depraw_globals(void)
+{
+	RC_STRINGLIST *inputs = rc_stringlist_new();
+
+	depraw_input(inputs, GENDEP);
+	depraw_input(inputs, RC_LIBEXECDIR "/sh/functions.sh");
+	depraw_input(inputs, RC_LIBEXECDIR "/sh/rc-functions.sh");
+	depraw_input(inputs, RC_CONF);
+	return inputs;
+}
+
+/* Work out which files gendepends read for this script */
+static void
+depraw_inputs(DEPRAW *raw)
+{
+	RC_STRING *s;
+	char *p, *line, *depends, *depend;
+	const char *svc;
+	char file[PATH_MAX];
+	int dirlen;
+
+	depraw_input(raw->inputs, raw->path);
+
+	svc = strrchr(raw->path, '/');
+	dirlen = svc - raw->path;
+	svc++;
+	snprintf(file, sizeof(file), "%.*s", dirlen, raw->path);
+	depraw_listing(raw->inputs, file);
+	p = strchr(svc, '.');
+	if (p && p != svc) {
+		snprintf(file, sizeof(file), "%.*s/../conf.d/%.*s",
+		    dirlen, raw->path, (int)(p - svc), svc);
+		depraw_input(raw->inputs, file);
+	}
+	snprintf(file, sizeof(file), "%.*s/../conf.d/%s",
+	    dirlen, raw->path, svc);
+	depraw_input(raw->inputs, file);
+
+	/* And anything it told us it reads */
+	TAILQ_FOREACH(s, raw->lines, entries) {
+		line = depends = xstrdup(s->value);
+		strsep(&depends, " ");
+		p = strsep(&depends, " ");
+		if (p && strcmp(p, "config") == 0)
+			while ((depend = strsep(&depends, " ")))
+				if (*depend)
+					depraw_input(raw->inputs, depend);
+		free(line);
+	}
+}
+
+static bool
+depraw_fresh(const RC_STRINGLIST *inputs)
+{
+	RC_STRINGLIST *now;
+	RC_STRING *s, *n;
+	const char *p;
+	int i, fields;
+	bool fresh = true;
+
+	now = rc_stringlist_new();
+	TAILQ_FOREACH(s, inputs, entries) {
+		if (strncmp(s->value, "file ", 5) == 0)
+			fields = 5;
+		else if (strncmp(s->value, "dir ", 4) == 0)
+			fields = 3;
+		else
+			break;
+		for (i = 0, p = s->value; i < fields && p; i++)
+			if ((p = strchr(p, ' ')))
+				p++;
+		if (!p)
+			break;
+		if (fields == 5)
+			depraw_input(now, p);
+		else
+			depraw_listing(now, p);
+	}
+	n = TAILQ_FIRST(now);
+	TAILQ_FOREACH(s, inputs, entries) {
+		if (!n || strcmp(s->value, n->value) != 0) {
+			fresh = false;
+			break;
+		}
+		n = TAILQ_NEXT(n, entries);
+	}
+	rc_stringlist_free(now);
+	return fresh;
+}
+
+/* Load what we saved last time, marking each script we don't need to
+ * source again as fresh */
+static DEPRAWS *
+depraw_load(void)
+{
+	DEPRAWS *raws;
+	DEPRAW *raw = NULL;
+	RC_STRINGLIST *globals;
+	FILE *fp;
+	char *line = NULL, *p, *key;
+	size_t len = 0;
+	bool fresh = false;
+
+	raws = xmalloc(sizeof(*raws));
+	TAILQ_INIT(raws);
+	if (!(fp = fopen(RC_DEPTREE_RAW, "r")))
+		return raws;
+
+	globals = rc_stringlist_new();
+	if (rc_getline(&line, &len, fp) &&
+	    strcmp(line, RC_DEPRAW_MAGIC) == 0)
+	{
+		fresh = true;
+		while ((rc_getline(&line, &len, fp))) {
+			p = line;
+			key = strsep(&p, " ");
+			if (!p)
+				continue;
+			if (strcmp(key, "script") == 0) {
+				raw = depraw_new(p);
+				TAILQ_INSERT_TAIL(raws, raw, entries);
+			} else if (strcmp(key, "input") == 0)
+				rc_stringlist_add(raw ? raw->inputs : globals, p);
+			else if (strcmp(key, "line") == 0 && raw)
+				rc_stringlist_add(raw->lines, p);
+		}
+	}
+	free(line);
+	fclose(fp);
+
+	if (fresh)
+		fresh = depraw_fresh(globals);
+	rc_stringlist_free(globals);
+	TAILQ_FOREACH(raw, raws, entries)
+		raw->fresh = fresh && depraw_fresh(raw->inputs);
+	return raws;
+}
+
+static void
+depraw_save(const DEPRAWS *raws)
+{
+	DEPRAW *raw;
+	RC_STRINGLIST *globals;
+	RC_STRING *s;
+	FILE *fp;
+	char tmp[PATH_MAX];
+
+	if (!(fp = save_open(RC_DEPTREE_RAW, tmp, sizeof(tmp))))
+		return;
+	fprintf(fp, "%s\n", RC_DEPRAW_MAGIC);
+	globals = depraw_globals();
+	TAILQ_FOREACH(s, globals, entries)
+		fprintf(fp, "input %s\n", s->value);
+	rc_stringlist_free(globals);
+	TAILQ_FOREACH(raw, raws, entries) {
+		fprintf(fp, "script %s\n", raw->path);
+		TAILQ_FOREACH(s, raw->inputs, entries)
+			fprintf(fp, "input %s\n", s->value);
+		TAILQ_FOREACH(s, raw->lines, entries)
+			fprintf(fp, "line %s\n", s->value);
+	}
+	save_close(fp, tmp, RC_DEPTREE_RAW, true);
+}
+
+/* Lines from a worker are tagged with the number of the script in the
+ * init.d listings, which tells us which worker it came from */
+static bool
+gendep_tag(const char *line, size_t nworkers, size_t worker,
+	   unsigned long *seq, const char **rest)
+{
+	char *p;
+
+	if (!isdigit((unsigned char)*line))
+		return false;
+	errno = 0;
+	*seq = strtoul(line, &p, 10);
+	if (errno || *p != ' ' || *seq % nworkers != worker)
+		return false;
+	*rest = p + 1;
+	return true;
+}
+
+static int
+depraw_cmp(const void *a, const void *b)
+{
+	const DEPRAW *ra = *(DEPRAW *const *)a;
+	const DEPRAW *rb = *(DEPRAW *const *)b;
+
+	if (ra->seq < rb->seq)
+		return -1;
+	return ra->seq > rb->seq;
+}
+
+/* List the scripts we still have fresh output for in a file the workers
+ * read, as there can be too many to pass as arguments */
+static bool
+depfresh_save(const DEPRAWS *cache)
+{
+	DEPRAW *raw;
+	FILE *fp;
+
+	if (!(fp = fopen(RC_DEPFRESH, "w")))
+		return false;
+	TAILQ_FOREACH(raw, cache, entries)
+		if (raw->fresh)
+			fprintf(fp, "%s\n", raw->path);
+	if (fclose(fp) != 0) {
+		unlink(RC_DEPFRESH);
+		return false;
+	}
+	return true;
+}
+
+/* Split the listing of init scripts over the gendepends workers, telling
+ * them not to bother with any scripts we still have fresh output for, and
+ * return what each script printed in the order of a serial run.
+ * Returns NULL if we could not, so the caller can run serially. */
+static DEPRAWS *
+gendepends_workers(size_t nworkers, const DEPRAWS *cache)
+{
+	GENDEP_WORKER *workers, *w;
+	struct pollfd *pfds;
+	DEPRAWS *raws = NULL;
+	DEPRAW **blocks = NULL, *cur;
+	char *argv[5];
+	char worker[24], nw[24];
+	char *p, *line, *trailer, *e;
+	const char *rest;
+	int fds[2], status;
+	size_t i, nopen = 0, nspawned, nblocks = 0, blocksize = 0;
+	ssize_t r;
+	unsigned long total = 0, seq;
+	bool ok = true;
+
+	/* Without the list the workers just source every script */
+	argv[0] = UNCONST(GENDEP);
+	argv[1] = worker;
+	argv[2] = nw;
+	argv[3] = depfresh_save(cache) ? UNCONST(RC_DEPFRESH) : NULL;
+	argv[4] = NULL;
+
+	workers = xmalloc(sizeof(*workers) * nworkers);
+	memset(workers, 0, sizeof(*workers) * nworkers);
+	pfds = xmalloc(sizeof(*pfds) * nworkers);
+	snprintf(nw, sizeof(nw), "%zu", nworkers);
+	for (nspawned = 0; nspawned < nworkers; nspawned++) {
+		w = &workers[nspawned];
+		if (pipe(fds) == -1) {
+			ok = false;
+			break;
+		}
+		fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+		if ((w->pid = fork()) == -1) {
+			close(fds[0]);
+			close(fds[1]);
+			ok = false;
+			break;
+		}
+		if (w->pid == 0) {
+			dup2(fds[1], STDOUT_FILENO);
+			snprintf(worker, sizeof(worker), "%zu", nspawned);
+			execv(GENDEP, argv);
+			_exit(EXIT_FAILURE);
+		}
+		close(fds[1]);
+		w->fd = fds[0];
+		pfds[nspawned].fd = fds[0];
+		pfds[nspawned].events = POLLIN;
+		nopen++;
+	}
+
+	/* Drain every worker as it writes so none of them block on a
+	 * full pipe */
+	while (ok && nopen) {
+		if (poll(pfds, nspawned, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			ok = false;
+			break;
+		}
+		for (i = 0; i < nspawned; i++) {
+			if (pfds[i].fd == -1 || !pfds[i].revents)
+				continue;
+			w = &workers[i];
+			if (w->size - w->len < BUFSIZ + 1) {
+				w->size += BUFSIZ * 4;
+				w->buf = xrealloc(w->buf, w->size);
+			}
+			r = read(w->fd, w->buf + w->len, w->size - w->len - 1);
+			if (r == -1 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			if (r <= 0) {
+				if (r == -1)
+					ok = false;
+				close(w->fd);
+				pfds[i].fd = -1;
+				nopen--;
+				continue;
+			}
+			w->len += r;
+		}
+	}
+
+	for (i = 0; i < nspawned; i++) {
+		w = &workers[i];
+		if (pfds[i].fd != -1)
+			close(w->fd);
+		/* rc may reap our workers for us, in which case the
+		 * trailer is all we have to go on */
+		while (waitpid(w->pid, &status, 0) == -1) {
+			if (errno != EINTR) {
+				status = 0;
+				break;
+			}
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			ok = false;
+	}
+	free(pfds);
+	if (argv[3])
+		unlink(RC_DEPFRESH);
+
+	/* Each worker finishes with the number of scripts it saw, which
+	 * must be the same for all of them or they listed different
+	 * directories */
+	for (i = 0; ok && i < nworkers; i++) {
+		w = &workers[i];
+		if (!w->buf || !w->len || w->buf[w->len - 1] != '\n') {
+			ok = false;
+			break;
+		}
+		w->buf[w->len - 1] = '\0';
+		trailer = strrchr(w->buf, '\n');
+		trailer = trailer ? trailer + 1 : w->buf;
+		errno = 0;
+		seq = strtoul(trailer, &e, 10);
+		if (errno || e == trailer || *e != '\0' ||
+		    (i != 0 && seq != total))
+		{
+			ok = false;
+			break;
+		}
+		total = seq;
+		*trailer = '\0';
+	}
+
+	/* Every script a worker looked at starts with its path, followed
+	 * by what it printed. Lines without a tag must have come from a
+	 * value with a newline in it, so stay with the script before. */
+	for (i = 0; ok && i < nworkers; i++) {
+		cur = NULL;
+		p = workers[i].buf;
+		while (*p) {
+			line = strsep(&p, "\n");
+			if (!p)
+				p = line + strlen(line);
+			if (gendep_tag(line, nworkers, i, &seq, &rest)) {
+				if (*rest == '/' && (!cur || seq > cur->seq)) {
+					cur = depraw_new(rest);
+					cur->seq = seq;
+					if (nblocks == blocksize) {
+						blocksize += 64;
+						blocks = xrealloc(blocks,
+						    sizeof(*blocks) * blocksize);
+					}
+					blocks[nblocks++] = cur;
+					continue;
+				}
+				if (cur && seq == cur->seq) {
+					rc_stringlist_add(cur->lines, rest);
+					continue;
+				}
+			}
+			if (cur)
+				rc_stringlist_add(cur->lines, line);
+		}
+	}
+
+	if (ok) {
+		qsort(blocks, nblocks, sizeof(*blocks), depraw_cmp);
+		raws = xmalloc(sizeof(*raws));
+		TAILQ_INIT(raws);
+		for (i = 0; i < nblocks; i++)
+			TAILQ_INSERT_TAIL(raws, blocks[i], entries);
+	} else
+		for (i = 0; i < nblocks; i++)
+			depraw_free(blocks[i]);
+
+	free(blocks);
+	for (i = 0; i < nworkers; i++)
+		free(workers[i].buf);
+	free(workers);
+	return raws;
+}
+
+/* Run gendepends and return what it printed for each script, only
+ * sourcing the scripts whose files have changed since last time */
+static DEPRAWS *
+gendepends(void)
+{
+	DEPRAWS *cache, *raws;
+	DEPRAW *raw, *old;
+	RC_STRINGLIST *lines;
+	FILE *fp;
+	char *line = NULL;
+	size_t len = 0, nworkers = 1;
+	const char *p;
+	long ncpus;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	p = rc_conf_value("rc_depend_parallel");
+	if (ncpus > 1 && (!p || rc_yesno(p)))
+		nworkers = ncpus;
+
+	cache = depraw_load();
+	if ((raws = gendepends_workers(nworkers, cache))) {
+		TAILQ_FOREACH(raw, raws, entries) {
+			TAILQ_FOREACH(old, cache, entries)
+				if (strcmp(old->path, raw->path) == 0)
+					break;
+			if (old && old->fresh) {
+				lines = raw->lines;
+				raw->lines = old->lines;
+				old->lines = lines;
+				lines = raw->inputs;
+				raw->inputs = old->inputs;
+				old->inputs = lines;
+			} else
+				depraw_inputs(raw);
+			if (old) {
+				TAILQ_REMOVE(cache, old, entries);
+				depraw_free(old);
+			}
+		}
+		depraws_free(cache);
+		depraw_save(raws);
+		return raws;
+	}
+	depraws_free(cache);
+
+	/* Fall back to sourcing everything in one go */
+	unlink(RC_DEPTREE_RAW);
+	if (!(fp = popen(GENDEP, "r")))
+		return NULL;
+	raws = xmalloc(sizeof(*raws));
+	TAILQ_INIT(raws);
+	raw = depraw_new(NULL);
+	TAILQ_INSERT_TAIL(raws, raw, entries);
+	while ((rc_getline(&line, &len, fp)))
+		rc_stringlist_add(raw->lines, line);
+	free(line);
+	pclose(fp);
+	return raws;
+}
+
+/* Append the contents of file to fp */
+static bool
+shlib_append(FILE *fp, const char *file)
+{
+	char buf[BUFSIZ];
+	size_t len;
+	FILE *in;
+	bool retval;
+
+	if (!(in = fopen(file, "r")))
+		return false;
+	fprintf(fp, "# %s\n", file);
+	while ((len = fread(buf, 1, sizeof(buf), in)))
+		fwrite(buf, 1, len, fp);
+	retval = !ferror(in);
+	fclose(in);
+	fputc('\n', fp);
+	return retval;
+}
+
+/* runscript.sh sources the same libraries for every command it runs.
+ * Flatten them into one file it can source instead, which we rebuild
+ * whenever the deptree is as they are part of its inputs. */
+static void
+shlib_save(void)
+{
+	const char *sys = rc_sys();
+	char *p, tmp[PATH_MAX];
+	FILE *fp;
+	bool ok;
+
+	p = rc_conf_value("rc_functions_cache");
+	if (!p || !rc_yesno(p)) {
+		unlink(RC_SHLIB);
+		return;
+	}
+
+	if (!(fp = save_open(RC_SHLIB, tmp, sizeof(tmp))))
+		return;
+	fprintf(fp, "# Generated by rc from the files below, do not edit\n");
+	ok = shlib_append(fp, RC_LIBEXECDIR "/sh/functions.sh") &&
+	    shlib_append(fp, RC_LIBEXECDIR "/sh/rc-functions.sh");
+	if (ok && (!sys || strcmp(sys, RC_SYS_PREFIX) != 0) &&
+	    exists(RC_LIBEXECDIR "/sh/rc-cgroup.sh"))
+		ok = shlib_append(fp, RC_LIBEXECDIR "/sh/rc-cgroup.sh");
+	/* Support LiveCD foo */
+	if (ok && exists(RC_LIVECD_SHLIB) &&
+	    (ok = shlib_append(fp, RC_LIVECD_SHLIB)))
+		fprintf(fp, "livecd_read_commandline\n");
+	if (!save_close(fp, tmp, RC_SHLIB, ok))
+		unlink(RC_SHLIB);
+}
+
 /* This is a 6 phase operation
    Phase 1 is a shell script which loads each init script and config in turn
    and echos their dependency info to stdout
@@ -739,17 +2507,23 @@ bool
 rc_deptree_update(void)
 {
 	FILE *fp;
-	RC_DEPTREE *deptree, *providers;
+	RC_DEPLIST *deptree, *providers;
 	RC_DEPINFO *depinfo = NULL, *depinfo_np, *di;
 	RC_DEPTYPE *deptype = NULL, *dt_np, *dt, *provide;
-	RC_STRINGLIST *config, *types, *sorted, *visited;
-	RC_STRING *s, *s2, *s2_np, *s3, *s4;
-	char *line = NULL;
-	size_t len = 0;
+	DEPRAWS *raws;
+	DEPRAW *raw;
+	RC_STRINGLIST *config, *sorted, *runlevels;
+	RC_STRING *line, *s, *s2, *s2_np, *s3, *s4;
+	RC_DEPTREE *order;
+	DEPINDEX index;
+	char *image;
+	size_t len;
 	char *depend, *depends, *service, *type, *nosys, *onosys;
 	size_t i, k, l;
+	int t;
 	bool retval = true;
 	const char *sys = rc_sys();
+	const char *svcname;
 	struct utsname uts;
 
 	/* Some init scripts need RC_LIBEXECDIR to source stuff
@@ -760,28 +2534,27 @@ rc_deptree_update(void)
 	if (uname(&uts) == 0)
 		setenv("RC_UNAME", uts.sysname, 1);
 	/* Phase 1 - source all init scripts and print dependencies */
-	if (!(fp = popen(GENDEP, "r")))
+	if (!(raws = gendepends()))
 		return false;
 
 	deptree = xmalloc(sizeof(*deptree));
 	TAILQ_INIT(deptree);
+	memset(&index, 0, sizeof(index));
 	config = rc_stringlist_new();
-	while ((rc_getline(&line, &len, fp)))
+	TAILQ_FOREACH(raw, raws, entries)
+	TAILQ_FOREACH(line, raw->lines, entries)
 	{
-		depends = line;
+		depends = line->value;
 		service = strsep(&depends, " ");
 		if (!service || !*service)
 			continue;
 
 		type = strsep(&depends, " ");
 		if (!depinfo || strcmp(depinfo->service, service) != 0) {
-			deptype = NULL;
-			depinfo = get_depinfo(deptree, service);
+			depinfo = get_depinfo(&index, service);
 			if (!depinfo) {
-				depinfo = xmalloc(sizeof(*depinfo));
-				TAILQ_INIT(&depinfo->depends);
-				depinfo->service = xstrdup(service);
-				TAILQ_INSERT_TAIL(deptree, depinfo, entries);
+				depinfo = depinfo_new(deptree, service);
+				depindex_add(&index, depinfo);
 			}
 		}
 
@@ -790,15 +2563,12 @@ rc_deptree_update(void)
 			continue;
 
 		/* Get the type */
+		t = -1;
 		if (strcmp(type, "config") != 0) {
-			if (!deptype || strcmp(deptype->type, type) != 0)
-				deptype = get_deptype(depinfo, type);
-			if (!deptype) {
-				deptype = xmalloc(sizeof(*deptype));
-				deptype->type = xstrdup(type);
-				deptype->services = rc_stringlist_new();
-				TAILQ_INSERT_TAIL(&depinfo->depends, deptype, entries);
-			}
+			if ((t = deptype_intern(type)) == -1)
+				continue;
+			if (!(deptype = get_deptype(depinfo, t)))
+				deptype = deptype_new(depinfo, t);
 		}
 
 		/* Now add each depend to our type.
@@ -808,13 +2578,13 @@ rc_deptree_update(void)
 			if (depend[0] == 0)
 				continue;
 
-			if (strcmp(type, "config") == 0) {
+			if (t == -1) {
 				rc_stringlist_addu(config, depend);
 				continue;
 			}
 
 			/* Don't provide ourself */
-			if (strcmp(type, "iprovide") == 0 &&
+			if (t == RC_DT_IPROVIDE &&
 			    strcmp(depend, service) == 0)
 				continue;
 
@@ -837,21 +2607,20 @@ rc_deptree_update(void)
 			/* We need to allow `after *; before local;` to work.
 			 * Conversely, we need to allow 'before *; after modules' also */
 			/* If we're before something, remove us from the after list */
-			if (strcmp(type, "ibefore") == 0) {
-				if ((dt = get_deptype(depinfo, "iafter")))
+			if (t == RC_DT_IBEFORE) {
+				if ((dt = get_deptype(depinfo, RC_DT_IAFTER)))
 					rc_stringlist_delete(dt->services, depend);
 			}
 			/* If we're after something, remove us from the before list */
-			if (strcmp(type, "iafter") == 0 ||
-			    strcmp(type, "ineed") == 0 ||
-			    strcmp(type, "iuse") == 0) {
-				if ((dt = get_deptype(depinfo, "ibefore")))
+			if (t == RC_DT_IAFTER ||
+			    t == RC_DT_INEED ||
+			    t == RC_DT_IUSE) {
+				if ((dt = get_deptype(depinfo, RC_DT_IBEFORE)))
 					rc_stringlist_delete(dt->services, depend);
 			}
 		}
 	}
-	free(line);
-	pclose(fp);
+	depraws_free(raws);
 
 	/* Phase 2 - if we're a special system, remove services that don't
 	 * work for them. This doesn't stop them from being run directly. */
@@ -871,12 +2640,12 @@ rc_deptree_update(void)
 		onosys[i + 2] = '\0';
 
 		TAILQ_FOREACH_SAFE(depinfo, deptree, entries, depinfo_np)
-			if ((deptype = get_deptype(depinfo, "keyword")))
+			if ((deptype = get_deptype(depinfo, RC_DT_KEYWORD)))
 				TAILQ_FOREACH(s, deptype->services, entries)
 					if (strcmp(s->value, nosys) == 0 ||
 					    strcmp(s->value, onosys) == 0)
 					{
-						provide = get_deptype(depinfo, "iprovide");
+						provide = get_deptype(depinfo, RC_DT_IPROVIDE);
 						TAILQ_REMOVE(deptree, depinfo, entries);
 						TAILQ_FOREACH(di, deptree, entries) {
 							TAILQ_FOREACH_SAFE(dt, &di->depends, entries, dt_np) {
@@ -885,6 +2654,9 @@ rc_deptree_update(void)
 									TAILQ_FOREACH(s2, provide->services, entries)
 										rc_stringlist_delete(dt->services, s2->value);
 								if (!TAILQ_FIRST(dt->services)) {
+									for (t = 0; t < RC_DT_MAX; t++)
+										if (di->deptypes[t] == dt)
+											di->deptypes[t] = NULL;
 									TAILQ_REMOVE(&di->depends, dt, entries);
 									free(dt->type);
 									free(dt->services);
@@ -895,91 +2667,83 @@ rc_deptree_update(void)
 					}
 		free(nosys);
 		free(onosys);
+		depindex_build(&index, deptree);
 	}
 
 	/* Phase 3 - add our providers to the tree */
 	providers = xmalloc(sizeof(*providers));
 	TAILQ_INIT(providers);
 	TAILQ_FOREACH(depinfo, deptree, entries)
-		if ((deptype = get_deptype(depinfo, "iprovide")))
+		if ((deptype = get_deptype(depinfo, RC_DT_IPROVIDE)))
 			TAILQ_FOREACH(s, deptype->services, entries) {
 				TAILQ_FOREACH(di, providers, entries)
 					if (strcmp(di->service, s->value) == 0)
 						break;
-				if (!di) {
-					di = xmalloc(sizeof(*di));
-					TAILQ_INIT(&di->depends);
-					di->service = xstrdup(s->value);
-					TAILQ_INSERT_TAIL(providers, di, entries);
-				}
+				if (!di)
+					depinfo_new(providers, s->value);
 			}
 	TAILQ_CONCAT(deptree, providers, entries);
 	free(providers);
+	depindex_build(&index, deptree);
 
 	/* Phase 4 - backreference our depends */
 	TAILQ_FOREACH(depinfo, deptree, entries)
-		for (i = 0; deppairs[i].depend; i++) {
+		for (i = 0; i < ARRAY_SIZE(deppairs); i++) {
 			deptype = get_deptype(depinfo, deppairs[i].depend);
 			if (!deptype)
 				continue;
 			TAILQ_FOREACH(s, deptype->services, entries) {
-				di = get_depinfo(deptree, s->value);
+				di = get_depinfo(&index, s->value);
 				if (!di) {
-					if (strcmp(deptype->type, "ineed") == 0) {
+					if (deppairs[i].depend == RC_DT_INEED) {
 						fprintf(stderr,
 							 "Service `%s' needs non"
 							 " existent service `%s'\n",
 							 depinfo->service, s->value);
-						dt = get_deptype(depinfo, "broken");
-						if (!dt) {
-							dt = xmalloc(sizeof(*dt));
-							dt->type = xstrdup("broken");
-							dt->services = rc_stringlist_new();
-							TAILQ_INSERT_TAIL(&depinfo->depends, dt, entries);
-						}
+						dt = get_deptype(depinfo, RC_DT_BROKEN);
+						if (!dt)
+							dt = deptype_new(depinfo, RC_DT_BROKEN);
 						rc_stringlist_addu(dt->services, s->value);
 					}
 					continue;
 				}
 
 				dt = get_deptype(di, deppairs[i].addto);
-				if (!dt) {
-					dt = xmalloc(sizeof(*dt));
-					dt->type = xstrdup(deppairs[i].addto);
-					dt->services = rc_stringlist_new();
-					TAILQ_INSERT_TAIL(&di->depends, dt, entries);
-				}
+				if (!dt)
+					dt = deptype_new(di, deppairs[i].addto);
 				rc_stringlist_addu(dt->services, depinfo->service);
 			}
 		}
 
 
 	/* Phase 5 - Remove broken before directives */
-	types = rc_stringlist_new();
-	rc_stringlist_add(types, "ineed");
-	rc_stringlist_add(types, "iuse");
-	rc_stringlist_add(types, "iafter");
+	svcname = getenv("RC_SVCNAME");
 	TAILQ_FOREACH(depinfo, deptree, entries) {
-		deptype = get_deptype(depinfo, "ibefore");
+		deptype = get_deptype(depinfo, RC_DT_IBEFORE);
 		if (!deptype)
 			continue;
+		/* Everything we directly need, use or come after, followed
+		 * by ourselves unless we are provided by something */
 		sorted = rc_stringlist_new();
-		visited = rc_stringlist_new();
-		visit_service(deptree, types, sorted, visited, depinfo,
-			      NULL, 0);
-		rc_stringlist_free(visited);
+		for (i = 0; i < ARRAY_SIZE(afters); i++)
+			if ((dt = get_deptype(depinfo, afters[i])))
+				TAILQ_FOREACH(s, dt->services, entries)
+					rc_stringlist_add(sorted, s->value);
+		if ((!svcname || strcmp(svcname, depinfo->service) != 0) &&
+		    !get_deptype(depinfo, RC_DT_PROVIDEDBY))
+			rc_stringlist_add(sorted, depinfo->service);
 		TAILQ_FOREACH_SAFE(s2, deptype->services, entries, s2_np) {
 			TAILQ_FOREACH(s3, sorted, entries) {
-				di = get_depinfo(deptree, s3->value);
+				di = get_depinfo(&index, s3->value);
 				if (!di)
 					continue;
 				if (strcmp(s2->value, s3->value) == 0) {
-					dt = get_deptype(di, "iafter");
+					dt = get_deptype(di, RC_DT_IAFTER);
 					if (dt)
 						rc_stringlist_delete(dt->services, depinfo->service);
 					break;
 				}
-				dt = get_deptype(di, "iprovide");
+				dt = get_deptype(di, RC_DT_IPROVIDE);
 				if (!dt)
 					continue;
 				TAILQ_FOREACH(s4, dt->services, entries) {
@@ -987,9 +2751,9 @@ rc_deptree_update(void)
 						break;
 				}
 				if (s4) {
-					di = get_depinfo(deptree, s4->value);
+					di = get_depinfo(&index, s4->value);
 					if (di) {
-						dt = get_deptype(di, "iafter");
+						dt = get_deptype(di, RC_DT_IAFTER);
 						if (dt)
 							rc_stringlist_delete(dt->services, depinfo->service);
 					}
@@ -1001,7 +2765,6 @@ rc_deptree_update(void)
 		}
 		rc_stringlist_free(sorted);
 	}
-	rc_stringlist_free(types);
 
 	/* Phase 6 - save to disk
 	   Now that we're purely in C, do we need to keep a shell parseable file?
@@ -1032,6 +2795,28 @@ rc_deptree_update(void)
 		retval = false;
 	}
 
+	/* Save the same tree in binary form so loading it is just a mmap */
+	if (!(image = deptree_compile(deptree, &len)) ||
+	    !deptree_save(RC_DEPTREE_BIN, image, len))
+	{
+		fprintf(stderr, "save `%s': %s\n",
+			RC_DEPTREE_BIN, strerror(errno));
+		unlink(RC_DEPTREE_BIN);
+		free(image);
+		retval = false;
+	} else if ((order = deptree_new(image, len, false))) {
+		/* Work out the order rc starts each runlevel in now, so
+		 * changing runlevel only has to check the providedby choices */
+		runlevels = rc_runlevel_list();
+		TAILQ_FOREACH(s, runlevels, entries)
+			rc_stringlist_free(rc_deptree_order_runlevel(order,
+			    s->value, RC_DEP_START));
+		rc_stringlist_free(runlevels);
+		rc_deptree_free(order);
+	}
+
+	shlib_save();
+
 	/* Save our external config files to disk */
 	if (TAILQ_FIRST(config)) {
 		if ((fp = fopen(RC_DEPCONFIG, "w"))) {
@@ -1048,7 +2833,8 @@ rc_deptree_update(void)
 	}
 
 	rc_stringlist_free(config);
-	rc_deptree_free(deptree);
+	free(index.slots);
+	deplist_free(deptree);
 	return retval;
 }
 librc_hidden_def(rc_deptree_update)
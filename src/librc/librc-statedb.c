@@ -0,0 +1,398 @@
+/*
+  librc-statedb
+  Keep the state of each service in one file rather than as symlinks
+*/
+
+/*
+ * Copyright (c) 2007-2008 Roy Marples <roy@marples.name>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "librc.h"
+
+#define STATEDB_MAGIC		"RCstate"
+#define STATEDB_VERSION		1
+#define STATEDB_RECORDS		2048
+#define STATEDB_SYMLINKS	0x01
+#define STATEDB_SPILLED		0x02	/* some states are in the directories */
+#define STATEDB_SPILL		0x80000000U	/* this one is */
+#define STATEDB_TMP		RC_STATEDB ".tmp"
+
+/* The first record is the header, the rest are hashed by service name.
+ * A record is never freed, so once used its name stays put and the state
+ * is the only thing which changes. Writers lock just that record and
+ * store the new state in one go, so readers never need a lock.
+ * A service which doesn't fit, as its names are too long or the records
+ * have run out, keeps its state in the directories instead. */
+typedef struct statedb_record {
+	volatile uint32_t used;
+	volatile uint32_t state;
+	char service[88];
+	char init[160];
+} STATEDB_RECORD;
+
+typedef struct statedb_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t records;
+	volatile uint32_t flags;
+} STATEDB_HEADER;
+
+static int db_fd = -2;
+static STATEDB_RECORD *db;
+static size_t db_len;
+static size_t db_records;
+static bool db_symlinks;
+
+void
+statedb_close(void)
+{
+	if (db)
+		munmap(db, db_len);
+	if (db_fd >= 0)
+		close(db_fd);
+	db = NULL;
+	db_fd = -1;
+}
+
+static bool
+statedb_map(const char *file)
+{
+	struct stat st;
+	const STATEDB_HEADER *hdr;
+	int prot = PROT_READ | PROT_WRITE;
+	void *p;
+
+	/* Users can still read it */
+	if ((db_fd = open(file, O_RDWR | O_CLOEXEC)) == -1) {
+		if (errno != EACCES ||
+		    (db_fd = open(file, O_RDONLY | O_CLOEXEC)) == -1)
+			return false;
+		prot = PROT_READ;
+	}
+	if (fstat(db_fd, &st) == -1 ||
+	    (size_t)st.st_size < sizeof(*db))
+		return false;
+	p = mmap(NULL, st.st_size, prot, MAP_SHARED, db_fd, 0);
+	if (p == MAP_FAILED)
+		return false;
+	db = p;
+	db_len = st.st_size;
+
+	hdr = p;
+	if (memcmp(hdr->magic, STATEDB_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != STATEDB_VERSION ||
+	    hdr->records == 0 ||
+	    (hdr->records & (hdr->records - 1)) != 0 ||
+	    db_len != (hdr->records + 1) * sizeof(*db))
+		return false;
+	db_records = hdr->records;
+	db_symlinks = hdr->flags & STATEDB_SYMLINKS;
+	return true;
+}
+
+bool
+statedb_open(void)
+{
+	bool missing;
+
+	if (db_fd == -2 && !statedb_map(RC_STATEDB)) {
+		/* Keep looking for it until openrc has made it */
+		missing = db_fd == -1 && errno == ENOENT;
+		statedb_close();
+		if (missing)
+			db_fd = -2;
+	}
+	return db != NULL;
+}
+
+bool
+statedb_symlinks(void)
+{
+	return statedb_open() && db_symlinks;
+}
+
+static bool
+statedb_lock(const STATEDB_RECORD *r, short type)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = (off_t)(r - db) * sizeof(*db);
+	fl.l_len = sizeof(*db);
+	while (fcntl(db_fd, F_SETLKW, &fl) == -1)
+		if (errno != EINTR)
+			return false;
+	return true;
+}
+
+/* Find the record of a service. Given an init script we claim a free
+ * record if it has none and return it locked for writing. */
+static STATEDB_RECORD *
+statedb_find(const char *service, const char *init)
+{
+	STATEDB_RECORD *r;
+	const char *p;
+	uint32_t h = 2166136261U;
+	size_t i, n;
+
+	if (strlen(service) >= sizeof(r->service) ||
+	    (init && strlen(init) >= sizeof(r->init)))
+	{
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	for (p = service; *p; p++) {
+		h ^= (unsigned char)*p;
+		h *= 16777619U;
+	}
+	i = h & (db_records - 1);
+	for (n = 0; n < db_records; n++) {
+		r = db + 1 + i;
+		if (!r->used) {
+			if (!init)
+				return NULL;
+			if (!statedb_lock(r, F_WRLCK))
+				return NULL;
+			if (!r->used) {
+				strlcpy(r->service, service,
+				    sizeof(r->service));
+				strlcpy(r->init, init, sizeof(r->init));
+				r->state = 0;
+				/* Readers must see the name before
+				 * the record is used */
+				__sync_synchronize();
+				r->used = 1;
+				return r;
+			}
+			/* Someone beat us to it */
+			statedb_lock(r, F_UNLCK);
+		}
+		if (strcmp(r->service, service) == 0) {
+			if (init) {
+				if (!statedb_lock(r, F_WRLCK))
+					return NULL;
+				if (strcmp(r->init, init) != 0)
+					strlcpy(r->init, init,
+					    sizeof(r->init));
+			}
+			return r;
+		}
+		i = (i + 1) & (db_records - 1);
+	}
+	errno = ENOSPC;
+	return NULL;
+}
+
+/* Returns -1 if the state of the service is in the directories */
+int
+statedb_state(const char *service)
+{
+	const STATEDB_RECORD *r = statedb_find(service, NULL);
+
+	if (r)
+		return r->state & STATEDB_SPILL ? -1 : (int)r->state;
+	if (errno == ENAMETOOLONG ||
+	    ((const STATEDB_HEADER *)db)->flags & STATEDB_SPILLED)
+		return -1;
+	return 0;
+}
+
+/* Whether any service keeps its state in the directories */
+bool
+statedb_spilled(void)
+{
+	return ((const STATEDB_HEADER *)db)->flags & STATEDB_SPILLED;
+}
+
+/* Move a service which doesn't fit to the directories for good */
+static void
+statedb_spill(const char *service)
+{
+	STATEDB_HEADER *hdr = (STATEDB_HEADER *)db;
+	STATEDB_RECORD *r;
+	int serrno = errno;
+
+	if (!(hdr->flags & STATEDB_SPILLED) &&
+	    statedb_lock((STATEDB_RECORD *)db, F_WRLCK))
+	{
+		hdr->flags |= STATEDB_SPILLED;
+		statedb_lock((STATEDB_RECORD *)db, F_UNLCK);
+	}
+	/* Only the init script may be too long for a service we know */
+	if ((r = statedb_find(service, NULL)) &&
+	    statedb_lock(r, F_WRLCK))
+	{
+		r->state = STATEDB_SPILL;
+		statedb_lock(r, F_UNLCK);
+	}
+	errno = serrno;
+}
+
+/* The init script of a service we know is started or inactive */
+char *
+statedb_init(const char *service)
+{
+	const STATEDB_RECORD *r = statedb_find(service, NULL);
+
+	if (!r || r->state & STATEDB_SPILL ||
+	    !(r->state & (RC_SERVICE_STARTED | RC_SERVICE_INACTIVE)))
+		return NULL;
+	return xstrdup(r->init);
+}
+
+/* Make the same change rc_service_mark makes to the state directories.
+ * Fails with ENAMETOOLONG or ENOSPC if the service has to use them. */
+bool
+statedb_mark(const char *service, const char *init, RC_SERVICE state)
+{
+	STATEDB_RECORD *r;
+	uint32_t s;
+	int clear;
+
+	if (!(r = statedb_find(service, init))) {
+		if (errno == ENAMETOOLONG || errno == ENOSPC)
+			statedb_spill(service);
+		return false;
+	}
+	if (r->state & STATEDB_SPILL) {
+		statedb_lock(r, F_UNLCK);
+		errno = ENOSPC;
+		return false;
+	}
+
+	s = r->state;
+	if (state & STATEDB_STATES)
+		s |= state;
+	if (state != RC_SERVICE_HOTPLUGGED) {
+		clear = (STATEDB_STATES & ~RC_SERVICE_HOTPLUGGED) & ~state;
+		if ((state == RC_SERVICE_STARTING ||
+			state == RC_SERVICE_STOPPING) &&
+		    s & RC_SERVICE_INACTIVE)
+		{
+			s |= RC_SERVICE_WASINACTIVE;
+			clear &= ~RC_SERVICE_WASINACTIVE;
+		}
+		s &= ~clear;
+	}
+	r->state = s;
+
+	statedb_lock(r, F_UNLCK);
+	return true;
+}
+
+/* Clear state from a service, such as hotplugged which marking it
+ * never does */
+bool
+statedb_clear(const char *service, RC_SERVICE state)
+{
+	STATEDB_RECORD *r;
+
+	/* A service without a record has nothing to clear */
+	if (!(r = statedb_find(service, NULL)))
+		return true;
+	if (!statedb_lock(r, F_WRLCK))
+		return false;
+	if (!(r->state & STATEDB_SPILL))
+		r->state &= ~state;
+	statedb_lock(r, F_UNLCK);
+	return true;
+}
+
+void
+statedb_foreach(void (*fn)(const char *, const char *, int, void *),
+    void *arg)
+{
+	const STATEDB_RECORD *r;
+	size_t i;
+
+	for (i = 0; i < db_records; i++) {
+		r = db + 1 + i;
+		if (r->used && r->state && !(r->state & STATEDB_SPILL))
+			fn(r->service, r->init, r->state, arg);
+	}
+}
+
+/* Start a new, empty state file which replaces the old one when
+ * committed. */
+bool
+statedb_create(bool symlinks)
+{
+	STATEDB_HEADER hdr;
+	int fd;
+	bool retval;
+
+	statedb_close();
+	unlink(STATEDB_TMP);
+	if ((fd = open(STATEDB_TMP, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+		    0644)) == -1)
+		return false;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, STATEDB_MAGIC, sizeof(hdr.magic));
+	hdr.version = STATEDB_VERSION;
+	hdr.records = STATEDB_RECORDS;
+	hdr.flags = symlinks ? STATEDB_SYMLINKS : 0;
+	retval = ftruncate(fd,
+	    (off_t)(STATEDB_RECORDS + 1) * sizeof(STATEDB_RECORD)) == 0 &&
+	    write(fd, &hdr, sizeof(hdr)) == sizeof(hdr);
+	close(fd);
+	if (!retval || !statedb_map(STATEDB_TMP)) {
+		statedb_commit(false);
+		return false;
+	}
+	return true;
+}
+
+/* Carry over a state from the state directories */
+bool
+statedb_import(const char *service, const char *init, RC_SERVICE state)
+{
+	STATEDB_RECORD *r;
+
+	if (!(state & STATEDB_STATES))
+		return true;
+	if (!(r = statedb_find(service, init))) {
+		if (errno != ENAMETOOLONG && errno != ENOSPC)
+			return false;
+		statedb_spill(service);
+		return true;
+	}
+	if (!(r->state & STATEDB_SPILL))
+		r->state |= state;
+	statedb_lock(r, F_UNLCK);
+	return true;
+}
+
+bool
+statedb_commit(bool keep)
+{
+	if (keep && rename(STATEDB_TMP, RC_STATEDB) == 0)
+		return true;
+	unlink(STATEDB_TMP);
+	statedb_close();
+	return false;
+}
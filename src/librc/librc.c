@@ -50,6 +50,20 @@ typedef struct rc_service_state_name {
 	const char *name;
 } rc_service_state_name_t;
 
+/* A service seen in the state directories */
+typedef struct svcstate {
+	char *service;
+	int state;
+	bool scheduled;
+} SVCSTATE;
+
+/* Open addressing table of them, keyed by name */
+struct rc_service_states {
+	SVCSTATE *slots;
+	size_t size;
+	size_t count;
+};
+
 /* We MUST list the states below 0x10 first
  * The rest can be in any order */
 static const rc_service_state_name_t rc_service_state_names[] = {
@@ -474,6 +488,7 @@ rc_service_resolve(const char *service)
 {
 	char buffer[PATH_MAX];
 	char file[PATH_MAX];
+	char *init;
 	int r;
 	struct stat buf;
 
@@ -499,6 +514,10 @@ rc_service_resolve(const char *service)
 			return xstrdup(buffer);
 	}
 
+	/* Without the symlinks the state file knows where it was */
+	if (statedb_open() && (init = statedb_init(service)))
+		return init;
+
 #ifdef RC_LOCAL_INITDIR
 	/* Nope, so lets see if the user has written it */
 	snprintf(file, sizeof(file), RC_LOCAL_INITDIR "/%s", service);
@@ -658,17 +677,36 @@ rc_service_mark(const char *service, const RC_SERVICE state)
 	RC_STRINGLIST *dirs;
 	RC_STRING *dir;
 	int serrno;
+	bool links = true;
 
 	if (!init)
 		return false;
 
 	base = basename_c(service);
-	if (state != RC_SERVICE_STOPPED) {
-		if (!exists(init)) {
-			free(init);
-			return false;
+	if (state != RC_SERVICE_STOPPED && !exists(init)) {
+		free(init);
+		return false;
+	}
+
+	/* The state file moves us to the new state in one write.
+	 * Failed services are still kept in their directory, as are
+	 * services which don't fit in it. */
+	if (statedb_open()) {
+		links = statedb_symlinks();
+		if (state != RC_SERVICE_FAILED &&
+		    !statedb_mark(base, init, state))
+		{
+			if (errno != ENAMETOOLONG && errno != ENOSPC) {
+				free(init);
+				return false;
+			}
+			links = true;
 		}
+	}
 
+	if (state != RC_SERVICE_STOPPED &&
+	    (links || state == RC_SERVICE_FAILED))
+	{
 		snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s",
 		    rc_parse_service_state(state), base);
 		if (exists(file))
@@ -694,7 +732,8 @@ rc_service_mark(const char *service, const RC_SERVICE state)
 			s != RC_SERVICE_STOPPED &&
 			s != RC_SERVICE_HOTPLUGGED &&
 			s != RC_SERVICE_SCHEDULED) &&
-		    (! skip_wasinactive || s != RC_SERVICE_WASINACTIVE))
+		    (! skip_wasinactive || s != RC_SERVICE_WASINACTIVE) &&
+		    (links || s == RC_SERVICE_FAILED))
 		{
 			snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s",
 			    rc_service_state_names[i].name, base);
@@ -773,11 +812,16 @@ rc_service_state(const char *service)
 	RC_STRINGLIST *dirs;
 	RC_STRING *dir;
 	const char *base = basename_c(service);
+	int dbstate = statedb_open() ? statedb_state(base) : -1;
+	bool db = dbstate != -1;
 
 	for (i = 0; rc_service_state_names[i].name; i++) {
 		snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s",
 		    rc_service_state_names[i].name, base);
-		if (exists(file)) {
+		if (db && rc_service_state_names[i].state & STATEDB_STATES ?
+		    dbstate & rc_service_state_names[i].state :
+		    exists(file))
+		{
 			if (rc_service_state_names[i].state <= 0x10)
 				state = rc_service_state_names[i].state;
 			else
@@ -803,6 +847,226 @@ rc_service_state(const char *service)
 }
 librc_hidden_def(rc_service_state)
 
+bool
+rc_service_statedb_create(bool symlinks)
+{
+	char dir[PATH_MAX], file[PATH_MAX], init[PATH_MAX];
+	RC_STRINGLIST *services;
+	RC_STRING *svc;
+	ssize_t l;
+	bool retval = true;
+	int i;
+
+	if (!statedb_create(symlinks))
+		return false;
+
+	for (i = 0; retval && rc_service_state_names[i].name; i++) {
+		if (!(rc_service_state_names[i].state & STATEDB_STATES))
+			continue;
+		snprintf(dir, sizeof(dir), RC_SVCDIR "/%s",
+		    rc_service_state_names[i].name);
+		services = ls_dir(dir, 0);
+		TAILQ_FOREACH(svc, services, entries) {
+			l = snprintf(file, sizeof(file), "%s/%s",
+			    dir, svc->value);
+			if (l < 0 || (size_t)l >= sizeof(file) ||
+			    (l = readlink(file, init, sizeof(init) - 1)) == -1)
+				continue;
+			init[l] = '\0';
+			if (!statedb_import(svc->value, init,
+				rc_service_state_names[i].state))
+			{
+				retval = false;
+				break;
+			}
+		}
+		rc_stringlist_free(services);
+	}
+	if (!statedb_commit(retval))
+		return false;
+
+	/* Don't leave symlinks around which are no longer kept current */
+	for (i = 0; !symlinks && rc_service_state_names[i].name; i++) {
+		if (!(rc_service_state_names[i].state & STATEDB_STATES))
+			continue;
+		snprintf(dir, sizeof(dir), RC_SVCDIR "/%s",
+		    rc_service_state_names[i].name);
+		services = ls_dir(dir, 0);
+		TAILQ_FOREACH(svc, services, entries) {
+			/* Unless the service didn't fit */
+			if (statedb_state(svc->value) == -1)
+				continue;
+			l = snprintf(file, sizeof(file), "%s/%s",
+			    dir, svc->value);
+			if (l >= 0 && (size_t)l < sizeof(file))
+				unlink(file);
+		}
+		rc_stringlist_free(services);
+	}
+	return true;
+}
+librc_hidden_def(rc_service_statedb_create)
+
+/* Find the slot for a service, hashed with FNV-1a */
+static SVCSTATE *
+svcstate_find(const RC_SERVICE_STATES *states, const char *service)
+{
+	const char *p;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (p = service; *p; p++) {
+		h ^= (unsigned char)*p;
+		h *= 16777619U;
+	}
+	i = h & (states->size - 1);
+	while (states->slots[i].service &&
+	    strcmp(states->slots[i].service, service) != 0)
+		i = (i + 1) & (states->size - 1);
+	return &states->slots[i];
+}
+
+static SVCSTATE *
+svcstate_add(RC_SERVICE_STATES *states, const char *service)
+{
+	SVCSTATE *old = states->slots, *s;
+	size_t i, size = states->size;
+
+	if ((states->count + 1) * 2 > states->size) {
+		states->size = size * 2;
+		states->slots = xmalloc(sizeof(*s) * states->size);
+		memset(states->slots, 0, sizeof(*s) * states->size);
+		for (i = 0; i < size; i++)
+			if (old[i].service)
+				*svcstate_find(states, old[i].service) = old[i];
+		free(old);
+	}
+
+	s = svcstate_find(states, service);
+	if (!s->service) {
+		s->service = xstrdup(service);
+		s->state = RC_SERVICE_STOPPED;
+		states->count++;
+	}
+	return s;
+}
+
+/* Work out a state the same way as from the state directories */
+static int
+statedb_to_state(int dbstate)
+{
+	int i, state = RC_SERVICE_STOPPED;
+
+	for (i = 0; rc_service_state_names[i].name; i++) {
+		if (!(dbstate & rc_service_state_names[i].state))
+			continue;
+		if (rc_service_state_names[i].state <= 0x10)
+			state = rc_service_state_names[i].state;
+		else
+			state |= rc_service_state_names[i].state;
+	}
+	return state;
+}
+
+static void
+statedb_load(const char *service, _unused const char *init, int dbstate,
+    void *arg)
+{
+	svcstate_add(arg, service)->state = statedb_to_state(dbstate);
+}
+
+RC_SERVICE_STATES *
+rc_service_states_load(void)
+{
+	RC_SERVICE_STATES *states;
+	SVCSTATE *s;
+	DIR *dp, *sdp;
+	struct dirent *d, *sd;
+	char dir[PATH_MAX];
+	int i;
+	bool db = statedb_open();
+
+	states = xmalloc(sizeof(*states));
+	states->count = 0;
+	states->size = 64;
+	states->slots = xmalloc(sizeof(*s) * states->size);
+	memset(states->slots, 0, sizeof(*s) * states->size);
+	if (db)
+		statedb_foreach(statedb_load, states);
+
+	/* Read each state directory once, rather than checking each
+	 * service in each of them */
+	for (i = 0; rc_service_state_names[i].name; i++) {
+		if (db && rc_service_state_names[i].state & STATEDB_STATES &&
+		    !statedb_spilled())
+			continue;
+		snprintf(dir, sizeof(dir), RC_SVCDIR "/%s",
+		    rc_service_state_names[i].name);
+		if (!(dp = opendir(dir)))
+			continue;
+		while ((d = readdir(dp))) {
+			if (d->d_name[0] == '.')
+				continue;
+			s = svcstate_add(states, d->d_name);
+			if (rc_service_state_names[i].state <= 0x10)
+				s->state = rc_service_state_names[i].state;
+			else
+				s->state |= rc_service_state_names[i].state;
+		}
+		closedir(dp);
+	}
+
+	/* Note which services another has scheduled to start */
+	if ((dp = opendir(RC_SVCDIR "/scheduled"))) {
+		while ((d = readdir(dp))) {
+			if (d->d_name[0] == '.')
+				continue;
+			snprintf(dir, sizeof(dir), RC_SVCDIR "/scheduled/%s",
+			    d->d_name);
+			if (!(sdp = opendir(dir)))
+				continue;
+			while ((sd = readdir(sdp)))
+				if (sd->d_name[0] != '.')
+					svcstate_add(states,
+					    sd->d_name)->scheduled = true;
+			closedir(sdp);
+		}
+		closedir(dp);
+	}
+
+	return states;
+}
+librc_hidden_def(rc_service_states_load)
+
+RC_SERVICE
+rc_service_states_get(const RC_SERVICE_STATES *states, const char *service)
+{
+	const SVCSTATE *s = svcstate_find(states, basename_c(service));
+	int state = RC_SERVICE_STOPPED;
+
+	if (s->service) {
+		state = s->state;
+		if (state & RC_SERVICE_STOPPED && s->scheduled)
+			state |= RC_SERVICE_SCHEDULED;
+	}
+	return state;
+}
+librc_hidden_def(rc_service_states_get)
+
+void
+rc_service_states_free(RC_SERVICE_STATES *states)
+{
+	size_t i;
+
+	if (!states)
+		return;
+	for (i = 0; i < states->size; i++)
+		free(states->slots[i].service);
+	free(states->slots);
+	free(states);
+}
+librc_hidden_def(rc_service_states_free)
+
 char *
 rc_service_value_get(const char *service, const char *option)
 {
@@ -880,6 +1144,21 @@ rc_service_schedule_clear(const char *service)
 }
 librc_hidden_def(rc_service_schedule_clear)
 
+bool
+rc_service_hotplug_clear(const char *service)
+{
+	char file[PATH_MAX];
+	const char *base = basename_c(service);
+
+	if (statedb_open() && !statedb_clear(base, RC_SERVICE_HOTPLUGGED))
+		return false;
+	snprintf(file, sizeof(file), RC_SVCDIR "/hotplugged/%s", base);
+	if (exists(file) && unlink(file) != 0)
+		return false;
+	return true;
+}
+librc_hidden_def(rc_service_hotplug_clear)
+
 RC_STRINGLIST *
 rc_services_in_runlevel(const char *runlevel)
 {
@@ -935,6 +1214,27 @@ rc_services_in_runlevel_stacked(const char *runlevel)
 }
 librc_hidden_def(rc_services_in_runlevel_stacked)
 
+struct in_state {
+	int state;
+	RC_STRINGLIST *list;
+};
+
+static void
+statedb_in_state(const char *service, const char *init, int dbstate,
+    void *arg)
+{
+	struct in_state *in_state = arg;
+	size_t l = strlen(service);
+
+	if (!(dbstate & in_state->state))
+		return;
+	/* Same checks as ls_dir makes of the symlinks */
+	if (!exists(init) ||
+	    (l > 2 && strcmp(service + l - 3, ".sh") == 0))
+		return;
+	rc_stringlist_add(in_state->list, service);
+}
+
 RC_STRINGLIST *
 rc_services_in_state(RC_SERVICE state)
 {
@@ -944,10 +1244,25 @@ rc_services_in_state(RC_SERVICE state)
 	RC_STRING *d;
 	char dir[PATH_MAX];
 	char *p = dir;
+	struct in_state in_state;
 
 	p += snprintf(dir, sizeof(dir), RC_SVCDIR "/%s",
 	    rc_parse_service_state(state));
 
+	if (state & STATEDB_STATES && statedb_open()) {
+		list = rc_stringlist_new();
+		in_state.state = state;
+		in_state.list = list;
+		statedb_foreach(statedb_in_state, &in_state);
+		/* Along with those which didn't fit */
+		if (statedb_spilled() && (services = ls_dir(dir, LS_INITD))) {
+			TAILQ_FOREACH(d, services, entries)
+				rc_stringlist_addu(list, d->value);
+			rc_stringlist_free(services);
+		}
+		return list;
+	}
+
 	if (state != RC_SERVICE_SCHEDULED)
 		return ls_dir(dir, LS_INITD);
 
@@ -34,6 +34,7 @@
 #define _IN_LIBRC
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -50,6 +51,7 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -69,6 +71,25 @@
 #include "rc.h"
 #include "rc-misc.h"
 
+/* librc-statedb.c */
+#define STATEDB_STATES	(RC_SERVICE_STARTED | RC_SERVICE_STARTING | \
+    RC_SERVICE_STOPPING | RC_SERVICE_INACTIVE | RC_SERVICE_WASINACTIVE | \
+    RC_SERVICE_HOTPLUGGED)
+
+bool statedb_open(void);
+bool statedb_symlinks(void);
+void statedb_close(void);
+int statedb_state(const char *);
+bool statedb_spilled(void);
+char *statedb_init(const char *);
+bool statedb_mark(const char *, const char *, RC_SERVICE);
+bool statedb_clear(const char *, RC_SERVICE);
+void statedb_foreach(void (*)(const char *, const char *, int, void *),
+    void *);
+bool statedb_create(bool);
+bool statedb_import(const char *, const char *, RC_SERVICE);
+bool statedb_commit(bool);
+
 #include "hidden-visibility.h"
 #define librc_hidden_proto(x) hidden_proto(x)
 #define librc_hidden_def(x) hidden_def(x)
@@ -77,12 +98,15 @@ librc_hidden_proto(rc_conf_value)
 librc_hidden_proto(rc_config_list)
 librc_hidden_proto(rc_config_load)
 librc_hidden_proto(rc_config_value)
+librc_hidden_proto(rc_deptree_cycles)
 librc_hidden_proto(rc_deptree_depend)
 librc_hidden_proto(rc_deptree_depends)
 librc_hidden_proto(rc_deptree_free)
 librc_hidden_proto(rc_deptree_load)
 librc_hidden_proto(rc_deptree_load_file)
 librc_hidden_proto(rc_deptree_order)
+librc_hidden_proto(rc_deptree_order_runlevel)
+librc_hidden_proto(rc_deptree_provided_hits)
 librc_hidden_proto(rc_deptree_update)
 librc_hidden_proto(rc_deptree_update_needed)
 librc_hidden_proto(rc_find_pids)
@@ -90,6 +114,10 @@ librc_hidden_proto(rc_getfile)
 librc_hidden_proto(rc_getline)
 librc_hidden_proto(rc_newer_than)
 librc_hidden_proto(rc_proc_getent)
+librc_hidden_proto(rc_procs_daemons_crashed)
+librc_hidden_proto(rc_procs_find)
+librc_hidden_proto(rc_procs_free)
+librc_hidden_proto(rc_procs_new)
 librc_hidden_proto(rc_older_than)
 librc_hidden_proto(rc_runlevel_exists)
 librc_hidden_proto(rc_runlevel_get)
@@ -107,6 +135,7 @@ librc_hidden_proto(rc_service_delete)
 librc_hidden_proto(rc_service_description)
 librc_hidden_proto(rc_service_exists)
 librc_hidden_proto(rc_service_extra_commands)
+librc_hidden_proto(rc_service_hotplug_clear)
 librc_hidden_proto(rc_service_in_runlevel)
 librc_hidden_proto(rc_service_mark)
 librc_hidden_proto(rc_service_resolve)
@@ -119,6 +148,10 @@ librc_hidden_proto(rc_services_scheduled)
 librc_hidden_proto(rc_services_scheduled_by)
 librc_hidden_proto(rc_service_started_daemon)
 librc_hidden_proto(rc_service_state)
+librc_hidden_proto(rc_service_states_free)
+librc_hidden_proto(rc_service_states_get)
+librc_hidden_proto(rc_service_states_load)
+librc_hidden_proto(rc_service_statedb_create)
 librc_hidden_proto(rc_service_value_get)
 librc_hidden_proto(rc_service_value_set)
 librc_hidden_proto(rc_stringlist_add)
@@ -39,6 +39,7 @@ int start_stop_daemon(int, char **);
 int swclock(int, char **);
 
 void run_applets(int, char **);
+int applet_helper(void);
 
 /* Handy function so we can wrap einfo around our deptree */
 RC_DEPTREE *_rc_deptree_load (int, int *);
@@ -34,11 +34,21 @@
 #define SYSLOG_NAMES
 
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#  include <sys/inotify.h>
+#  include <sys/prctl.h>
+#endif
+
+#include <poll.h>
 
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <libgen.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -51,14 +61,89 @@
 #include "builtins.h"
 #include "einfo.h"
 #include "rc-misc.h"
+#include "rc-trace.h"
 
 /* usecs to wait while we poll the file existance  */
 #define WAIT_INTERVAL	20000000
+/* msecs to wait for inotify before we look anyway, as a mount
+ * can make a file appear without telling us */
+#define WAIT_RECHECK	1000
 #define ONE_SECOND      690000000
 
+/* The fd runscript.sh talks to our helper on, followed by the two ends
+ * of the pipe its subshells take turns with it through. They have to be
+ * one digit for a POSIX shell to redirect to them. */
+#define HELPER_FD	7
+/* Applets the helper runs itself must print no more than a pipe holds */
+#define HELPER_INLINE_MAX	1024
+
 /* Applet is first parsed in rc.c - no point in doing it again */
 extern const char *applet;
 
+/* Wait for a file to exist until stop, or forever if stop is NULL.
+ * Returns 1 when it does, 0 on timeout and -1 on error. */
+static int
+waitfile(const char *file, const struct timeval *stop)
+{
+	struct timeval now, left;
+	struct timespec ts;
+	int fd = -1, timeout, retval = 1;
+#ifdef __linux__
+	struct pollfd pfd;
+	char *path, buf[4096];
+
+	/* Have the kernel tell us when something appears next to it,
+	 * rather than looking every WAIT_INTERVAL */
+	if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) != -1) {
+		path = xstrdup(file);
+		if (inotify_add_watch(fd, dirname(path),
+			IN_CREATE | IN_MOVED_TO | IN_ATTRIB) == -1)
+		{
+			close(fd);
+			fd = -1;
+		}
+		free(path);
+	}
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+#endif
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = WAIT_INTERVAL;
+	while (!exists(file)) {
+		timeout = WAIT_RECHECK;
+		if (stop) {
+			gettimeofday(&now, NULL);
+			if (!timercmp(&now, stop, <)) {
+				retval = 0;
+				break;
+			}
+			timersub(stop, &now, &left);
+			if (left.tv_sec < WAIT_RECHECK / 1000)
+				timeout = left.tv_sec * 1000 +
+				    left.tv_usec / 1000 + 1;
+		}
+#ifdef __linux__
+		if (fd != -1) {
+			if (poll(&pfd, 1, timeout) == -1) {
+				retval = -1;
+				break;
+			}
+			while (read(fd, buf, sizeof(buf)) > 0)
+				;
+			continue;
+		}
+#endif
+		if (nanosleep(&ts, NULL) == -1) {
+			retval = -1;
+			break;
+		}
+	}
+	if (fd != -1)
+		close(fd);
+	return retval;
+}
+
 static int
 syslog_decode(char *name, CODE *codetab)
 {
@@ -83,8 +168,7 @@ do_e(int argc, char **argv)
 	char *message = NULL;
 	char *p;
 	int level = 0;
-	struct timespec ts;
-	struct timeval stop, now;
+	struct timeval stop;
 	int (*e) (const char *, ...) EINFO_PRINTF(1, 2) = NULL;
 	int (*ee) (int, const char *, ...) EINFO_PRINTF(2, 3) = NULL;
 
@@ -147,20 +231,12 @@ do_e(int argc, char **argv)
 		gettimeofday(&stop, NULL);
 		/* retval stores the timeout */
 		stop.tv_sec += retval;
-		ts.tv_sec = 0;
-		ts.tv_nsec = WAIT_INTERVAL;
 		for (i = 0; i < argc; i++) {
 			ebeginv("Waiting for %s", argv[i]);
-			for (;;) {
-				if (exists(argv[i]))
-					break;
-				if (nanosleep(&ts, NULL) == -1)
-					return EXIT_FAILURE;
-				gettimeofday(&now, NULL);
-				if (retval <= 0)
-					continue;
-				if (timercmp(&now, &stop, <))
-					continue;
+			switch (waitfile(argv[i], retval > 0 ? &stop : NULL)) {
+			case -1:
+				return EXIT_FAILURE;
+			case 0:
 				eendv(EXIT_FAILURE,
 				    "timed out waiting for %s", argv[i]);
 				return EXIT_FAILURE;
@@ -413,6 +489,36 @@ do_value(int argc, char **argv)
 	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
+static int
+service_trace(int argc, char **argv)
+{
+	static const struct {
+		const char * const name;
+		int point;
+	} points[] = {
+		{ "sourced", RC_TRACE_SOURCED  },
+		{ "pre",     RC_TRACE_PRE_OUT  },
+		{ "func",    RC_TRACE_FUNC_OUT },
+		{ "post",    RC_TRACE_POST_OUT },
+	};
+	char *service = getenv("RC_SVCNAME");
+	size_t i;
+
+	if (service == NULL)
+		eerrorx("%s: no service specified", applet);
+
+	if (argc < 2 || ! argv[1] || *argv[1] == '\0')
+		eerrorx("%s: no point specified", applet);
+
+	for (i = 0; i < ARRAY_SIZE(points); i++)
+		if (strcmp(argv[1], points[i].name) == 0) {
+			rc_trace(points[i].point, service);
+			return EXIT_SUCCESS;
+		}
+	eerrorx("%s: unknown point `%s'", applet, argv[1]);
+	/* NOTREACHED */
+}
+
 static int
 shell_var(int argc, char **argv)
 {
@@ -526,6 +632,7 @@ static const struct {
 	{ "service_set_value",   do_value,          },
 	{ "get_options",         do_value,          },
 	{ "save_options",        do_value,          },
+	A(service_trace),
 #undef A
 };
 
@@ -568,3 +675,486 @@ run_applets(int argc, char **argv)
 	if (strcmp(applet, "rc") != 0 && strcmp(applet, "openrc") != 0)
 		eerrorx("%s: unknown applet", applet);
 }
+
+
+/* What runscript.sh asks our helper to run */
+struct helper_request {
+	char *capture;		/* o and/or e for the streams to send back */
+	char *cwd;
+	RC_STRINGLIST *env;	/* NAME=VALUE, unset if VALUE is empty */
+	int argc;
+	char **argv;
+};
+
+/* Read a NUL terminated field of a request */
+static char *
+helper_field(FILE *fp, char **buf, size_t *len)
+{
+	if (getdelim(buf, len, '\0', fp) == -1)
+		return NULL;
+	return xstrdup(*buf);
+}
+
+static void
+helper_free(struct helper_request *req)
+{
+	int i;
+
+	free(req->capture);
+	free(req->cwd);
+	rc_stringlist_free(req->env);
+	for (i = 0; req->argv && i < req->argc; i++)
+		free(req->argv[i]);
+	free(req->argv);
+	memset(req, 0, sizeof(*req));
+}
+
+/* A request is the streams to capture, the working directory, the
+ * count and values of the environment the applet needs, then the
+ * count and values of its arguments. */
+static bool
+helper_read(FILE *fp, struct helper_request *req)
+{
+	char *buf = NULL, *p;
+	size_t len = 0;
+	int i, n;
+	bool ok = false;
+
+	memset(req, 0, sizeof(*req));
+	req->env = rc_stringlist_new();
+	if (!(req->capture = helper_field(fp, &buf, &len)) ||
+	    !(req->cwd = helper_field(fp, &buf, &len)) ||
+	    !(p = helper_field(fp, &buf, &len)))
+		goto out;
+	n = atoi(p);
+	free(p);
+	for (i = 0; i < n; i++) {
+		if (!(p = helper_field(fp, &buf, &len)))
+			goto out;
+		rc_stringlist_add(req->env, p);
+		free(p);
+	}
+	if (!(p = helper_field(fp, &buf, &len)))
+		goto out;
+	n = atoi(p);
+	free(p);
+	if (n < 1)
+		goto out;
+	req->argv = xmalloc(sizeof(char *) * (n + 1));
+	for (req->argc = 0; req->argc < n; req->argc++)
+		if (!(req->argv[req->argc] = helper_field(fp, &buf, &len)))
+			goto out;
+	req->argv[req->argc] = NULL;
+	ok = true;
+out:
+	free(buf);
+	return ok;
+}
+
+/* Send what an applet printed on a stream runscript.sh is capturing,
+ * a line at a time flagged with whether it ended in a newline */
+static void
+helper_relay(FILE *out, char stream, char *buf, size_t *len, bool flush)
+{
+	char *p = buf, *nl;
+
+	while ((nl = memchr(p, '\n', *len - (p - buf)))) {
+		fprintf(out, "%c1%.*s\n", stream, (int)(nl - p), p);
+		p = nl + 1;
+	}
+	*len -= p - buf;
+	if (flush && *len) {
+		fprintf(out, "%c0%.*s\n", stream, (int)*len, p);
+		*len = 0;
+	}
+	memmove(buf, p, *len);
+}
+
+/* Run the applet in a child, which already has the openrc binary
+ * and rc.conf loaded as it's a fork of us. */
+static int
+helper_run(struct helper_request *req, FILE *in, FILE *out)
+{
+	static const char stream[] = { 'o', 'e' };
+	RC_STRING *e;
+	struct pollfd pfd[2];
+	char buf[2][BUFSIZ];
+	size_t len[2] = { 0, 0 };
+	int fds[2][2], i, s, nfds, status;
+	ssize_t bytes;
+	pid_t pid;
+	char *p;
+
+	for (i = 0; i < 2; i++) {
+		fds[i][0] = fds[i][1] = -1;
+		if (strchr(req->capture, stream[i]) && pipe(fds[i]) == -1)
+			return EXIT_FAILURE;
+	}
+
+	fflush(out);
+	if ((pid = fork()) == -1)
+		return EXIT_FAILURE;
+	if (pid == 0) {
+		signal_setup(SIGALRM, SIG_DFL);
+		close(fileno(in));
+		close(fileno(out));
+		for (i = 0; i < 2; i++) {
+			if (fds[i][1] == -1)
+				continue;
+			close(fds[i][0]);
+			dup2(fds[i][1], i + 1);
+			close(fds[i][1]);
+		}
+		if (chdir(req->cwd) == -1)
+			eerror("%s: chdir `%s': %s",
+			    req->argv[0], req->cwd, strerror(errno));
+		TAILQ_FOREACH(e, req->env, entries) {
+			if ((p = strchr(e->value, '=')) == NULL)
+				continue;
+			*p++ = '\0';
+			if (*p)
+				setenv(e->value, p, 1);
+			else
+				unsetenv(e->value);
+		}
+		applet = basename_c(req->argv[0]);
+		/* runscript already parsed its options */
+		optind = 1;
+		run_applets(req->argc, req->argv);
+		eerror("%s: unknown applet", applet);
+		_exit(EXIT_FAILURE);
+	}
+
+	nfds = 0;
+	for (i = 0; i < 2; i++) {
+		if (fds[i][1] == -1)
+			continue;
+		close(fds[i][1]);
+		pfd[nfds].fd = fds[i][0];
+		pfd[nfds].events = POLLIN;
+		nfds++;
+	}
+	while (nfds > 0) {
+		if (poll(pfd, nfds, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = nfds - 1; i >= 0; i--) {
+			if (!pfd[i].revents)
+				continue;
+			s = pfd[i].fd == fds[0][0] ? 0 : 1;
+			bytes = read(pfd[i].fd, buf[s] + len[s],
+			    BUFSIZ - len[s]);
+			if (bytes == -1 && errno == EINTR)
+				continue;
+			if (bytes > 0)
+				len[s] += bytes;
+			helper_relay(out, stream[s], buf[s], &len[s],
+			    bytes <= 0 || len[s] == BUFSIZ);
+			if (bytes <= 0) {
+				close(pfd[i].fd);
+				pfd[i] = pfd[--nfds];
+			}
+		}
+	}
+	for (i = 0; i < nfds; i++)
+		close(pfd[i].fd);
+
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			return EXIT_FAILURE;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+/* Applets we can run in the helper itself, as they only return, and
+ * print little enough for a pipe to hold until they do. The others
+ * might exit or block, so they get a child of their own. */
+static bool
+helper_inline(const struct helper_request *req)
+{
+	const char *name = basename_c(req->argv[0]);
+	const char *service = NULL;
+	const RC_STRING *e;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < req->argc; i++)
+		len += strlen(req->argv[i]) + 1;
+	if (len > HELPER_INLINE_MAX)
+		return false;
+
+	if (name[0] == 'e' || (name[0] == 'v' && name[1] == 'e'))
+		return strcmp(name, "esyslog") != 0 &&
+		    strcmp(name, "elog") != 0 &&
+		    strcmp(name, "ewaitfile") != 0 &&
+		    strcmp(name, "eval_ecolors") != 0;
+	if (strncmp(name, "mark_service_", 13) == 0) {
+		if (!lookup_service_state(name + 5))
+			return false;
+	} else if (strncmp(name, "service_", 8) == 0) {
+		if (!lookup_service_state(name) &&
+		    strcmp(name, "service_started_daemon") != 0 &&
+		    strcmp(name, "service_crashed") != 0)
+			return false;
+	} else
+		return false;
+
+	/* These exit without a service to look at */
+	if (req->argc > 1)
+		service = req->argv[1];
+	else
+		TAILQ_FOREACH(e, req->env, entries)
+			if (strncmp(e->value, "RC_SVCNAME=", 11) == 0)
+				service = e->value + 11;
+	return service && *service;
+}
+
+/* Set the environment of a request, returning what to put back */
+static RC_STRINGLIST *
+helper_env(const RC_STRINGLIST *env)
+{
+	RC_STRINGLIST *old = rc_stringlist_new();
+	const RC_STRING *e;
+	char *name, *value, *p, *saved;
+	size_t len;
+
+	TAILQ_FOREACH(e, env, entries) {
+		name = xstrdup(e->value);
+		if ((value = strchr(name, '=')) == NULL) {
+			free(name);
+			continue;
+		}
+		*value++ = '\0';
+		if ((p = getenv(name))) {
+			len = strlen(name) + strlen(p) + 2;
+			saved = xmalloc(len);
+			snprintf(saved, len, "%s=%s", name, p);
+			rc_stringlist_add(old, saved);
+			free(saved);
+		} else
+			rc_stringlist_add(old, name);
+		if (*value)
+			setenv(name, value, 1);
+		else
+			unsetenv(name);
+		free(name);
+	}
+	return old;
+}
+
+/* Run an applet from helper_inline in the helper itself, sending back
+ * what it printed once it has returned. Returns false if we can't. */
+static bool
+helper_call(struct helper_request *req, FILE *out, int *status)
+{
+	static const char stream[] = { 'o', 'e' };
+	RC_STRINGLIST *old;
+	RC_STRING *e;
+	const char *name = basename_c(req->argv[0]);
+	const char *save = applet;
+	char buf[BUFSIZ];
+	size_t len;
+	int fds[2][2], keep[2], i;
+	bool ok = false;
+	ssize_t bytes;
+	char *p;
+
+	for (i = 0; i < 2; i++)
+		fds[i][0] = fds[i][1] = keep[i] = -1;
+	for (i = 0; i < 2; i++) {
+		if (!strchr(req->capture, stream[i]))
+			continue;
+		if (pipe(fds[i]) == -1 || (keep[i] = dup(i + 1)) == -1)
+			goto out;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < 2; i++)
+		if (fds[i][1] != -1)
+			dup2(fds[i][1], i + 1);
+	if (chdir(req->cwd) == -1)
+		eerror("%s: chdir `%s': %s", name, req->cwd, strerror(errno));
+	old = helper_env(req->env);
+	applet = name;
+	if (name[0] == 'e' || name[0] == 'v')
+		*status = do_e(req->argc, req->argv);
+	else if (strncmp(name, "mark_", 5) == 0)
+		*status = do_mark_service(req->argc, req->argv);
+	else
+		*status = do_service(req->argc, req->argv);
+	applet = save;
+	ok = true;
+	TAILQ_FOREACH(e, old, entries) {
+		if ((p = strchr(e->value, '=')) == NULL) {
+			unsetenv(e->value);
+			continue;
+		}
+		*p++ = '\0';
+		setenv(e->value, p, 1);
+	}
+	rc_stringlist_free(old);
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < 2; i++) {
+		if (keep[i] == -1)
+			continue;
+		dup2(keep[i], i + 1);
+		close(fds[i][1]);
+		fds[i][1] = -1;
+	}
+
+	/* Only the pipes hold their write ends open now */
+	for (i = 0; i < 2; i++) {
+		if (fds[i][0] == -1)
+			continue;
+		len = 0;
+		for (;;) {
+			bytes = read(fds[i][0], buf + len, sizeof(buf) - len);
+			if (bytes == -1 && errno == EINTR)
+				continue;
+			if (bytes > 0)
+				len += bytes;
+			helper_relay(out, stream[i], buf, &len,
+			    bytes <= 0 || len == sizeof(buf));
+			if (bytes <= 0)
+				break;
+		}
+	}
+
+out:
+	for (i = 0; i < 2; i++) {
+		if (fds[i][0] != -1)
+			close(fds[i][0]);
+		if (fds[i][1] != -1)
+			close(fds[i][1]);
+		if (keep[i] != -1)
+			close(keep[i]);
+	}
+	return ok;
+}
+
+/* Our parent is the shell. Whatever it leaves running in the background
+ * keeps the socket open after it exits, so look for it going ourselves
+ * where PR_SET_PDEATHSIG can't tell us. */
+static pid_t helper_ppid;
+
+static void
+helper_alarm(_unused int sig)
+{
+	if (getppid() != helper_ppid)
+		_exit(EXIT_SUCCESS);
+	alarm(1);
+}
+
+/* Answer runscript.sh until it goes away */
+static void
+helper_serve(int fd)
+{
+	struct helper_request req;
+	FILE *in, *out;
+	int dfd, status;
+
+	if ((dfd = dup(fd)) == -1 ||
+	    (in = fdopen(fd, "r")) == NULL ||
+	    (out = fdopen(dfd, "w")) == NULL)
+		return;
+	while (helper_read(in, &req)) {
+		if (!helper_inline(&req) || !helper_call(&req, out, &status))
+			status = helper_run(&req, in, out);
+		fprintf(out, "s%d\n", status);
+		fflush(out);
+		helper_free(&req);
+	}
+	helper_free(&req);
+}
+
+/* Fork a helper for runscript.sh to run our applets with, saving a
+ * fork and exec of openrc each time. We're about to exec the shell,
+ * so the helper goes when the shell does.
+ * Returns the fd to tell the shell about, or -1 if there is no helper. */
+int
+applet_helper(void)
+{
+	int sv[2], lock[2], fds[3], fd, i;
+	pid_t pid, ppid = getpid();
+	struct sigaction sa;
+
+	if (pipe(lock) == -1)
+		return -1;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		close(lock[0]);
+		close(lock[1]);
+		return -1;
+	}
+	if ((pid = fork()) == -1) {
+		close(sv[0]);
+		close(sv[1]);
+		close(lock[0]);
+		close(lock[1]);
+		return -1;
+	}
+	if (pid == 0) {
+#ifdef __linux__
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+		if (getppid() != ppid)
+			_exit(EXIT_SUCCESS);
+		/* Restart reads of the socket after checking */
+		helper_ppid = ppid;
+		memset(&sa, 0, sizeof(sa));
+		sigemptyset(&sa.sa_mask);
+		sa.sa_handler = helper_alarm;
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGALRM, &sa, NULL);
+		alarm(1);
+		signal_setup(SIGCHLD, SIG_DFL);
+		signal_setup(SIGHUP, SIG_DFL);
+		signal_setup(SIGINT, SIG_DFL);
+		signal_setup(SIGQUIT, SIG_DFL);
+		signal_setup(SIGTERM, SIG_DFL);
+		signal_setup(SIGWINCH, SIG_DFL);
+		/* Don't hold anything open, like the service lock */
+		for (i = getdtablesize() - 1; i >= 3; --i)
+			if (i != sv[1])
+				close(i);
+		helper_serve(sv[1]);
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(sv[1]);
+	/* The one line in the pipe is the turn to talk to the helper */
+	if (write(lock[1], "\n", 1) != 1) {
+		close(sv[0]);
+		close(lock[0]);
+		close(lock[1]);
+		return -1;
+	}
+
+	/* Move them all out of the way first, as any of them could be
+	 * where another has to go */
+	fds[0] = sv[0];
+	fds[1] = lock[0];
+	fds[2] = lock[1];
+	for (i = 0; i < 3; i++) {
+		fd = fcntl(fds[i], F_DUPFD, HELPER_FD + 3);
+		close(fds[i]);
+		fds[i] = fd;
+	}
+	for (i = 0; i < 3; i++) {
+		if (fds[i] == -1 || dup2(fds[i], HELPER_FD + i) == -1)
+			break;
+		close(fds[i]);
+		fds[i] = -1;
+	}
+	if (i == 3)
+		return HELPER_FD;
+	for (fd = 0; fd < 3; fd++) {
+		if (fd < i)
+			close(HELPER_FD + fd);
+		else if (fds[fd] != -1)
+			close(fds[fd]);
+	}
+	return -1;
+}
@@ -94,6 +94,7 @@ _rc_deptree_load(int force, int *regen) {
 				ut.actime = t;
 				ut.modtime = t;
 				utime(RC_DEPTREE_CACHE, &ut);
+				utime(RC_DEPTREE_BIN, &ut);
 			} else {
 				if (exists(RC_DEPTREE_SKEWED))
 					unlink(RC_DEPTREE_SKEWED);
@@ -105,10 +106,36 @@ _rc_deptree_load(int force, int *regen) {
 	return rc_deptree_load();
 }
 
+/* Show a loop as each service pointing at the one it depends on */
+static void
+print_loop(const char *loop)
+{
+	const char *p;
+	char *msg, *m;
+	size_t len;
+
+	len = strcspn(loop, " ");
+	m = msg = xmalloc(strlen(loop) * 4 + len + 5);
+	for (p = loop; *p; p++) {
+		if (*p == ' ') {
+			memcpy(m, " -> ", 4);
+			m += 4;
+		} else
+			*m++ = *p;
+	}
+	memcpy(m, " -> ", 4);
+	m += 4;
+	memcpy(m, loop, len);
+	m[len] = '\0';
+	eerror("%s: dependency loop: %s", applet, msg);
+	free(msg);
+}
+
 #include "_usage.h"
-#define getoptstring "aot:suTF:" getoptstring_COMMON
+#define getoptstring "acot:suTF:" getoptstring_COMMON
 static const struct option longopts[] = {
 	{ "starting", 0, NULL, 'a'},
+	{ "check",    0, NULL, 'c'},
 	{ "stopping", 0, NULL, 'o'},
 	{ "type",     1, NULL, 't'},
 	{ "notrace",  0, NULL, 'T'},
@@ -119,6 +146,7 @@ static const struct option longopts[] = {
 };
 static const char * const longopts_help[] = {
 	"Order services as if runlevel is starting",
+	"Report dependency loops",
 	"Order services as if runlevel is stopping",
 	"Type(s) of dependency to list",
 	"Don't trace service dependencies",
@@ -139,9 +167,10 @@ rc_depend(int argc, char **argv)
 	RC_STRING *s;
 	RC_DEPTREE *deptree = NULL;
 	int options = RC_DEP_TRACE, update = 0;
-	bool first = true;
+	bool first = true, check = false;
 	char *runlevel = xstrdup(getenv("RC_RUNLEVEL"));
 	int opt;
+	int retval;
 	char *token;
 	char *deptree_file = NULL;
 
@@ -153,6 +182,9 @@ rc_depend(int argc, char **argv)
 		case 'a':
 			options |= RC_DEP_START;
 			break;
+		case 'c':
+			check = true;
+			break;
 		case 'o':
 			options |= RC_DEP_STOP;
 			break;
@@ -204,6 +236,11 @@ rc_depend(int argc, char **argv)
 		rc_stringlist_free(list);
 		optind++;
 	}
+	/* With no services, check them all */
+	if (check && !TAILQ_FIRST(services)) {
+		rc_stringlist_free(services);
+		services = rc_services_in_runlevel(NULL);
+	}
 	if (!TAILQ_FIRST(services)) {
 		rc_stringlist_free(services);
 		rc_stringlist_free(types);
@@ -218,6 +255,22 @@ rc_depend(int argc, char **argv)
 	if (!TAILQ_FIRST(types)) {
 		rc_stringlist_add(types, "ineed");
 		rc_stringlist_add(types, "iuse");
+		if (check)
+			rc_stringlist_add(types, "iafter");
+	}
+
+	if (check) {
+		depends = rc_deptree_cycles(deptree, types, services,
+		    runlevel, options);
+		TAILQ_FOREACH(s, depends, entries)
+			print_loop(s->value);
+		retval = TAILQ_FIRST(depends) ? EXIT_FAILURE : EXIT_SUCCESS;
+		rc_stringlist_free(depends);
+		rc_stringlist_free(types);
+		rc_stringlist_free(services);
+		rc_deptree_free(deptree);
+		free(runlevel);
+		return retval;
 	}
 
 	depends = rc_deptree_depends(deptree, types, services,
@@ -31,10 +31,17 @@
 
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#ifdef __linux__
+#  include <sys/sendfile.h>
+#endif
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdio.h>
@@ -60,6 +67,9 @@
 
 #define TMPLOG RC_SVCDIR "/rc.log"
 #define DEFAULTLOG "/var/log/rc.log"
+#define LOG_IOV 128
+#define LOG_PROBE 1000		/* msecs between looking for somewhere to log */
+#define LOG_BUFFER 1024		/* KiB we hold when we can't log yet */
 
 static int signal_pipe[2] = { -1, -1 };
 static int fd_stdout = -1;
@@ -68,57 +78,190 @@ static const char *runlevel = NULL;
 static bool in_escape = false;
 static bool in_term = false;
 
+/* Until we can open a log we keep the latest output in a ring */
 static char *logbuf = NULL;
 static size_t logbuf_size = 0;
 static size_t logbuf_len = 0;
+static size_t logbuf_start = 0;
+static size_t logbuf_lost = 0;
 
 pid_t rc_logger_pid = -1;
 int rc_logger_tty = -1;
 bool rc_in_logger = false;
 
+static void
+ring_add(const char *p, size_t len)
+{
+	size_t end, n;
+
+	if (len > logbuf_size) {
+		logbuf_lost += len - logbuf_size;
+		p += len - logbuf_size;
+		len = logbuf_size;
+	}
+	if (logbuf_len + len > logbuf_size) {
+		n = logbuf_len + len - logbuf_size;
+		logbuf_lost += n;
+		logbuf_start = (logbuf_start + n) % logbuf_size;
+		logbuf_len -= n;
+	}
+	while (len > 0) {
+		end = (logbuf_start + logbuf_len) % logbuf_size;
+		n = logbuf_size - end;
+		if (n > len)
+			n = len;
+		memcpy(logbuf + end, p, n);
+		logbuf_len += n;
+		p += n;
+		len -= n;
+	}
+}
+
+static void
+ring_flush(int logfd)
+{
+	struct iovec iov[2];
+	size_t n;
+
+	if (logbuf_lost)
+		dprintf(logfd, "\nrc-logger lost %zu bytes\n", logbuf_lost);
+	n = logbuf_size - logbuf_start;
+	if (n > logbuf_len)
+		n = logbuf_len;
+	iov[0].iov_base = logbuf + logbuf_start;
+	iov[0].iov_len = n;
+	iov[1].iov_base = logbuf;
+	iov[1].iov_len = logbuf_len - n;
+	if (logbuf_len && writev(logfd, iov, 2) == -1)
+		eerror("writev: %s", strerror(errno));
+	logbuf_start = logbuf_len = logbuf_lost = 0;
+}
+
+/* Write to the log, or keep it in the ring if we don't have one yet */
+static void
+log_writev(int logfd, const struct iovec *iov, int n)
+{
+	int i;
+
+	if (logfd != -1) {
+		if (writev(logfd, iov, n) == -1)
+			eerror("writev: %s", strerror(errno));
+		return;
+	}
+	for (i = 0; i < n; i++)
+		ring_add(iov[i].iov_base, iov[i].iov_len);
+}
+
+/* Log what we can see of the output, skipping carriage returns and
+ * escape sequences. Runs of plain text go out together in one writev.
+ * An escape sequence can span buffers, so we remember where we are in
+ * one between calls. Without a log, the text goes into the ring. */
 static void
 write_log(int logfd, const char *buffer, size_t bytes)
 {
-	const char *p = buffer;
-
-	while ((size_t)(p - buffer) < bytes) {
-		switch (*p) {
-		case '\r':
-			goto cont;
-		case '\033':
-			in_escape = true;
-			in_term = false;
-			goto cont;
-		case '\n':
-			in_escape = in_term = false;
-			break;
-		case '[':
-			if (in_escape)
+	struct iovec iov[LOG_IOV];
+	const char *p = buffer, *end = buffer + bytes, *esc, *cr, *q;
+	int n = 0;
+
+	esc = cr = buffer;
+	while (p < end) {
+		if (in_escape) {
+			if (*p == '\n') {
+				in_escape = in_term = false;
+				continue;
+			}
+			if (*p == '\033')
+				in_term = false;
+			else if (*p == '[')
 				in_term = true;
-			break;
+			else if (*p != '\r' &&
+			    (!in_term || isalpha((unsigned char)*p)))
+				in_escape = in_term = false;
+			p++;
+			continue;
 		}
 
-		if (!in_escape) {
-			if (write(logfd, p++, 1) == -1)
-				eerror("write: %s", strerror(errno));
+		/* Find the next byte we don't log */
+		if (esc <= p && !(esc = memchr(p, '\033', end - p)))
+			esc = end;
+		if (cr <= p && !(cr = memchr(p, '\r', end - p)))
+			cr = end;
+		q = esc < cr ? esc : cr;
+		if (q == p) {
+			if (*p == '\033') {
+				in_escape = true;
+				in_term = false;
+			}
+			p++;
 			continue;
 		}
 
-		if (! in_term || isalpha((unsigned char)*p))
-			in_escape = in_term = false;
-cont:
-		p++;
+		if (n == LOG_IOV) {
+			log_writev(logfd, iov, n);
+			n = 0;
+		}
+		iov[n].iov_base = UNCONST(p);
+		iov[n++].iov_len = q - p;
+		p = q;
 	}
+
+	if (n)
+		log_writev(logfd, iov, n);
 }
 
 static void
-write_time(FILE *f, const char *s)
+write_time(int logfd, const char *s)
 {
 	time_t now = time(NULL);
 	struct tm *tm = localtime(&now);
 
-	fprintf(f, "\nrc %s logging %s at %s\n", runlevel, s, asctime(tm));
-	fflush(f);
+	dprintf(logfd, "\nrc %s logging %s at %s\n", runlevel, s, asctime(tm));
+}
+
+static int
+log_open(const char *file)
+{
+	return open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+/* See if we can log to the temporary log yet, or failing that straight
+ * to the real one as soon as its filesystem is writable. Whatever we
+ * held in the ring goes there first. */
+static int
+log_probe(const char *logfile, bool *direct)
+{
+	int logfd;
+
+	*direct = false;
+	if ((logfd = log_open(TMPLOG)) == -1) {
+		if ((logfd = log_open(logfile)) == -1)
+			return -1;
+		*direct = true;
+	}
+	write_time(logfd, "started");
+	ring_flush(logfd);
+	return logfd;
+}
+
+/* Append one file to another without bringing it into our memory */
+static bool
+log_copy(int in, int out)
+{
+	char buffer[BUFSIZ];
+	ssize_t bytes;
+
+#ifdef __linux__
+	while ((bytes = sendfile(out, in, NULL, INT_MAX)) > 0)
+		;
+	if (bytes == 0)
+		return true;
+	if (errno != EINVAL && errno != ENOSYS)
+		return false;
+#endif
+	while ((bytes = read(in, buffer, sizeof(buffer))) > 0)
+		if (write(out, buffer, bytes) != bytes)
+			return false;
+	return bytes == 0;
 }
 
 void
@@ -151,12 +294,14 @@ rc_logger_open(const char *level)
 	char buffer[BUFSIZ];
 	struct pollfd fd[2];
 	int s = 0;
-	size_t bytes;
+	ssize_t bytes;
 	int i;
-	FILE *log = NULL;
-	FILE *plog = NULL;
-	const char *logfile;
+	int log = -1;
+	int plog = -1;
+	const char *logfile, *p;
 	int log_error = 0;
+	bool direct = false;
+	time_t probed = 0;
 
 	if (!rc_conf_yesno("rc_logger"))
 		return;
@@ -194,13 +339,20 @@ rc_logger_open(const char *level)
 		signal_pipe[1] = -1;
 
 		runlevel = level;
-		if ((log = fopen(TMPLOG, "ae")))
+		logfile = rc_conf_value("rc_log_path");
+		if (logfile == NULL)
+			logfile = DEFAULTLOG;
+		if ((log = log_open(TMPLOG)) != -1)
 			write_time(log, "started");
 		else {
 			free(logbuf);
-			logbuf_size = BUFSIZ * 10;
+			p = rc_conf_value("rc_log_buffer");
+			logbuf_size = (p ? strtoul(p, NULL, 10) : LOG_BUFFER) * 1024;
+			if (logbuf_size == 0)
+				logbuf_size = BUFSIZ;
 			logbuf = xmalloc(sizeof (char) * logbuf_size);
-			logbuf_len = 0;
+			logbuf_len = logbuf_start = logbuf_lost = 0;
+			probed = time(NULL);
 		}
 
 		fd[0].fd = signal_pipe[0];
@@ -209,33 +361,26 @@ rc_logger_open(const char *level)
 		if (rc_logger_tty >= 0)
 			fd[1].fd = rc_logger_tty;
 		for (;;) {
-			if ((s = poll(fd,
-				    rc_logger_tty >= 0 ? 2 : 1, -1)) == -1)
+			if ((s = poll(fd, rc_logger_tty >= 0 ? 2 : 1,
+				    log == -1 ? LOG_PROBE : -1)) == -1)
 			{
 				eerror("poll: %s", strerror(errno));
 				break;
-			} else if (s == 0)
+			}
+
+			if (log == -1 && time(NULL) != probed) {
+				log = log_probe(logfile, &direct);
+				probed = time(NULL);
+			}
+			if (s == 0)
 				continue;
 
 			if (fd[1].revents & (POLLIN | POLLHUP)) {
-				memset(buffer, 0, BUFSIZ);
 				bytes = read(rc_logger_tty, buffer, BUFSIZ);
-				if (write(STDOUT_FILENO, buffer, bytes) == -1)
-					eerror("write: %s", strerror(errno));
-
-				if (log)
-					write_log(fileno (log), buffer, bytes);
-				else {
-					if (logbuf_size - logbuf_len < bytes) {
-						logbuf_size += BUFSIZ * 10;
-						logbuf = xrealloc(logbuf,
-						    sizeof(char ) *
-						    logbuf_size);
-					}
-
-					memcpy(logbuf + logbuf_len,
-					    buffer, bytes);
-					logbuf_len += bytes;
+				if (bytes > 0) {
+					if (write(STDOUT_FILENO, buffer, bytes) == -1)
+						eerror("write: %s", strerror(errno));
+					write_log(log, buffer, bytes);
 				}
 			}
 
@@ -243,39 +388,37 @@ rc_logger_open(const char *level)
 			if (fd[0].revents & (POLLIN | POLLHUP))
 				break;
 		}
-		if (logbuf) {
-			if ((log = fopen(TMPLOG, "ae"))) {
-				write_time(log, "started");
-				write_log(fileno(log), logbuf, logbuf_len);
-			}
-			free(logbuf);
-		}
-		if (log) {
+		if (log == -1)
+			log = log_probe(logfile, &direct);
+		free(logbuf);
+		logbuf = NULL;
+		if (log != -1) {
 			write_time(log, "stopped");
-			fclose(log);
+			close(log);
 		}
-
-		/* Append the temporary log to the real log */
-		logfile = rc_conf_value("rc_log_path");
-		if (logfile == NULL)
-			logfile = DEFAULTLOG;
-
-		if ((plog = fopen(logfile, "ae"))) {
-			if ((log = fopen(TMPLOG, "re"))) {
-				while ((bytes = fread(buffer, sizeof(*buffer), BUFSIZ, log)) > 0) {
-					if (fwrite(buffer, sizeof(*buffer), bytes, plog) < bytes) {
-						log_error = 1;
-						eerror("Error: write(%s) failed: %s", logfile, strerror(errno));
-						break;
-					}
+		/* We've been logging to the real log all along */
+		if (direct)
+			exit(0);
+
+		/* Append the temporary log to the real log.
+		 * We can't copy straight into an O_APPEND file, so seek */
+		if ((plog = open(logfile, O_WRONLY | O_CREAT | O_CLOEXEC,
+			    0644)) != -1)
+		{
+			if ((log = open(TMPLOG, O_RDONLY | O_CLOEXEC)) != -1) {
+				if (lseek(plog, 0, SEEK_END) == -1 ||
+				    !log_copy(log, plog))
+				{
+					log_error = 1;
+					eerror("Error: write(%s) failed: %s", logfile, strerror(errno));
 				}
+				close(log);
 			} else {
 				log_error = 1;
-				eerror("Error: fopen(%s) failed: %s", TMPLOG, strerror(errno));
+				eerror("Error: open(%s) failed: %s", TMPLOG, strerror(errno));
 			}
 
-			fclose(log);
-			fclose(plog);
+			close(plog);
 		} else {
 			/*
 			 * logfile or its basedir may be read-only during sysinit and
@@ -283,7 +426,7 @@ rc_logger_open(const char *level)
 			 */
 			if (errno != EROFS && ((strcmp(level, RC_LEVEL_SHUTDOWN) != 0) && (strcmp(level, RC_LEVEL_SYSINIT) != 0))) {
 				log_error = 1;
-				eerror("Error: fopen(%s) failed: %s", logfile, strerror(errno));
+				eerror("Error: open(%s) failed: %s", logfile, strerror(errno));
 			}
 		}
 
@@ -41,6 +41,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -257,11 +258,13 @@ pid_t
 exec_service(const char *service, const char *arg)
 {
 	char *file, sfd[32];
-	int fd;
+	char *argv[5];
+	int fd, r;
 	pid_t pid = -1;
 	sigset_t full;
 	sigset_t old;
-	struct sigaction sa;
+	sigset_t deflt;
+	posix_spawnattr_t attr;
 
 	fd = svc_lock(basename_c(service));
 	if (fd == -1)
@@ -276,37 +279,38 @@ exec_service(const char *service, const char *arg)
 	}
 	snprintf(sfd, sizeof(sfd), "%d", fd);
 
-	/* We need to block signals until we have forked */
-	memset(&sa, 0, sizeof (sa));
-	sa.sa_handler = SIG_DFL;
-	sigemptyset(&sa.sa_mask);
+	argv[0] = file;
+	argv[1] = UNCONST("--lockfd");
+	argv[2] = sfd;
+	argv[3] = UNCONST(arg);
+	argv[4] = NULL;
+
+	/* We need to block signals until we have spawned.
+	 * posix_spawn restores default handlers and unmasks signals in
+	 * the child without copying our page tables as fork would. */
 	sigfillset(&full);
 	sigprocmask(SIG_SETMASK, &full, &old);
-
-	if ((pid = fork()) == 0) {
-		/* Restore default handlers */
-		sigaction(SIGCHLD, &sa, NULL);
-		sigaction(SIGHUP, &sa, NULL);
-		sigaction(SIGINT, &sa, NULL);
-		sigaction(SIGQUIT, &sa, NULL);
-		sigaction(SIGTERM, &sa, NULL);
-		sigaction(SIGUSR1, &sa, NULL);
-		sigaction(SIGWINCH, &sa, NULL);
-
-		/* Unmask signals */
-		sigprocmask(SIG_SETMASK, &old, NULL);
-
-		/* Safe to run now */
-		execl(file, file, "--lockfd", sfd, arg, (char *) NULL);
+	sigemptyset(&deflt);
+	sigaddset(&deflt, SIGCHLD);
+	sigaddset(&deflt, SIGHUP);
+	sigaddset(&deflt, SIGINT);
+	sigaddset(&deflt, SIGQUIT);
+	sigaddset(&deflt, SIGTERM);
+	sigaddset(&deflt, SIGUSR1);
+	sigaddset(&deflt, SIGWINCH);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigdefault(&attr, &deflt);
+	posix_spawnattr_setsigmask(&attr, &old);
+	posix_spawnattr_setflags(&attr,
+	    POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+	r = posix_spawn(&pid, file, NULL, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	if (r != 0) {
 		fprintf(stderr, "unable to exec `%s': %s\n",
-		    file, strerror(errno));
-		svc_unlock(basename_c(service), fd);
-		_exit(EXIT_FAILURE);
-	}
-
-	if (pid == -1) {
-		fprintf(stderr, "fork: %s\n",strerror (errno));
+		    file, strerror(r));
 		svc_unlock(basename_c(service), fd);
+		pid = -1;
 	} else
 		fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
 
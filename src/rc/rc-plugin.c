@@ -47,6 +47,7 @@
 #include "rc.h"
 #include "rc-misc.h"
 #include "rc-plugin.h"
+#include "rc-trace.h"
 
 #define RC_PLUGIN_HOOK "rc_plugin_hook"
 
@@ -158,6 +159,9 @@ rc_plugin_run(RC_HOOK hook, const char *value)
 	if (rc_in_plugin)
 		return;
 
+	/* Every hook is a point worth tracing */
+	rc_trace(hook, value);
+
 	/* We need to block signals until we have forked */
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = SIG_DFL;
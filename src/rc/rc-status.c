@@ -29,6 +29,7 @@
  */
 
 #include <getopt.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,11 +40,14 @@
 #include "queue.h"
 #include "rc.h"
 #include "rc-misc.h"
+#include "rc-trace.h"
 
 extern const char *applet;
 static bool test_crashed = false;
 static RC_DEPTREE *deptree;
+static RC_SERVICE_STATES *states;
 static RC_STRINGLIST *types;
+static RC_PROCS *procs;
 
 static RC_STRINGLIST *levels, *services, *tmp, *alist;
 static RC_STRINGLIST *sservices, *nservices, *needsme;
@@ -61,7 +65,9 @@ _rc_can_find_pids(void)
 
 	/* If we cannot see process 1, then we don't test to see if
 	 * services crashed or not */
-	pids = rc_find_pids(NULL, NULL, 0, 1);
+	if (!procs)
+		procs = rc_procs_new();
+	pids = procs ? rc_procs_find(procs, NULL, NULL, 0, 1) : NULL;
 	if (pids) {
 		pid = LIST_FIRST(pids);
 		if (pid) {
@@ -77,6 +83,16 @@ _rc_can_find_pids(void)
 	return retval;
 }
 
+/* Check every service against the same snapshot of the processes,
+ * rather than reading them all again for each one */
+static bool
+daemons_crashed(const char *service)
+{
+	if (!procs)
+		procs = rc_procs_new();
+	return rc_procs_daemons_crashed(procs, service);
+}
+
 static void
 print_level(const char *prefix, const char *level)
 {
@@ -98,7 +114,7 @@ print_service(const char *service)
 	char status[10];
 	int cols =  printf(" %s", service);
 	const char *c = ecolor(ECOLOR_GOOD);
-	RC_SERVICE state = rc_service_state(service);
+	RC_SERVICE state = rc_service_states_get(states, service);
 	ECOLOR color = ECOLOR_BAD;
 
 	if (state & RC_SERVICE_STOPPING)
@@ -112,7 +128,7 @@ print_service(const char *service)
 	} else if (state & RC_SERVICE_STARTED) {
 		errno = 0;
 		if (test_crashed &&
-		    rc_service_daemons_crashed(service) &&
+		    daemons_crashed(service) &&
 		    errno != EACCES)
 		{
 			snprintf(status, sizeof(status), " crashed ");
@@ -191,17 +207,409 @@ print_stacked_services(const char *runlevel)
 	stackedlevels = NULL;
 }
 
+/* A service starting or stopping in the trace */
+typedef struct svctime {
+	const char *service;
+	bool stopping;
+	uint64_t in, now, done, out;
+	uint64_t wait, wait_in;
+	uint64_t sourced, pre, func, post, daemon_in;
+} SVCTIME;
+
+static const char *
+print_time(char *buf, size_t len, uint64_t ns, bool valid)
+{
+	if (valid)
+		snprintf(buf, len, "%llu.%03llus",
+		    (unsigned long long)(ns / 1000000000),
+		    (unsigned long long)(ns / 1000000 % 1000));
+	else
+		snprintf(buf, len, "-");
+	return buf;
+}
+
+static ssize_t
+svctime_find(const SVCTIME *times, size_t n, const char *service)
+{
+	size_t i;
+
+	for (i = n; i > 0; i--)
+		if (strcmp(times[i - 1].service, service) == 0)
+			return i - 1;
+	return -1;
+}
+
+/* Note when the service an event belongs to passed that point */
+static SVCTIME *
+svctime_event(SVCTIME **times, size_t *ntimes, const RC_TRACE_EVENT *event)
+{
+	SVCTIME *t;
+	ssize_t k;
+
+	if (event->point == RC_HOOK_SERVICE_START_IN ||
+	    event->point == RC_HOOK_SERVICE_STOP_IN)
+	{
+		*times = xrealloc(*times, sizeof(**times) * (*ntimes + 1));
+		t = &(*times)[(*ntimes)++];
+		memset(t, 0, sizeof(*t));
+		t->service = event->name;
+		t->stopping = event->point == RC_HOOK_SERVICE_STOP_IN;
+		t->in = event->time;
+		return t;
+	}
+	if ((k = svctime_find(*times, *ntimes, event->name)) == -1)
+		return NULL;
+	t = &(*times)[k];
+	switch (event->point) {
+	case RC_HOOK_SERVICE_START_NOW:
+	case RC_HOOK_SERVICE_STOP_NOW:
+		t->now = event->time;
+		break;
+	case RC_HOOK_SERVICE_START_DONE:
+	case RC_HOOK_SERVICE_STOP_DONE:
+		t->done = event->time;
+		break;
+	case RC_HOOK_SERVICE_START_OUT:
+	case RC_HOOK_SERVICE_STOP_OUT:
+		t->out = event->time;
+		break;
+	case RC_TRACE_WAIT_IN:
+		t->wait_in = event->time;
+		break;
+	case RC_TRACE_WAIT_OUT:
+		if (t->wait_in)
+			t->wait += event->time - t->wait_in;
+		t->wait_in = 0;
+		break;
+	case RC_TRACE_SOURCED:
+		t->sourced = event->time;
+		break;
+	case RC_TRACE_PRE_OUT:
+		t->pre = event->time;
+		break;
+	case RC_TRACE_FUNC_OUT:
+		t->func = event->time;
+		break;
+	case RC_TRACE_POST_OUT:
+		t->post = event->time;
+		break;
+	case RC_TRACE_DAEMON_IN:
+		t->daemon_in = event->time;
+		break;
+	}
+	return t;
+}
+
+static SVCTIME *
+load_times(const RC_TRACE_EVENT *events, size_t nevents, size_t *ntimes)
+{
+	SVCTIME *times = NULL;
+	size_t i;
+
+	*ntimes = 0;
+	for (i = 0; i < nevents; i++)
+		svctime_event(&times, ntimes, &events[i]);
+	return times;
+}
+
+/* Follow what each service waited for back from the last one to
+ * finish. What it waited for is whatever it depends on which finished
+ * last before it could run. */
+static void
+print_critical_path(const SVCTIME *times, size_t n, bool stopping)
+{
+	RC_STRINGLIST *deptypes, *one, *deps;
+	char *level;
+	size_t i, len = 0, *path;
+	ssize_t cur = -1, next;
+	char at[32], done[32], exec[32];
+
+	for (i = 0; i < n; i++)
+		if (times[i].stopping == stopping && times[i].done &&
+		    (cur == -1 || times[i].done > times[cur].done))
+			cur = i;
+	if (cur == -1)
+		return;
+
+	deptypes = rc_stringlist_new();
+	if (stopping) {
+		rc_stringlist_add(deptypes, "needsme");
+		rc_stringlist_add(deptypes, "usesme");
+		rc_stringlist_add(deptypes, "ibefore");
+	} else {
+		rc_stringlist_add(deptypes, "ineed");
+		rc_stringlist_add(deptypes, "iuse");
+		rc_stringlist_add(deptypes, "iafter");
+	}
+	one = rc_stringlist_new();
+	level = rc_runlevel_get();
+	path = xmalloc(sizeof(*path) * n);
+	while (cur != -1) {
+		path[len++] = cur;
+		rc_stringlist_add(one, times[cur].service);
+		deps = rc_deptree_depends(deptree, deptypes, one, level,
+		    RC_DEP_TRACE);
+		rc_stringlist_delete(one, times[cur].service);
+		next = -1;
+		for (i = 0; i < n; i++) {
+			if (times[i].stopping != stopping || !times[i].done ||
+			    times[i].done > times[cur].now ||
+			    (next != -1 && times[i].done <= times[next].done) ||
+			    !rc_stringlist_find(deps, times[i].service))
+				continue;
+			next = i;
+		}
+		rc_stringlist_free(deps);
+		cur = next;
+	}
+
+	printf("Critical path: %s\n",
+	    print_time(done, sizeof(done), times[path[0]].done, true));
+	while (len-- > 0) {
+		i = path[len];
+		printf(" %-28s %10s %10s %10s\n", times[i].service,
+		    print_time(at, sizeof(at), times[i].in, true),
+		    print_time(done, sizeof(done), times[i].done, true),
+		    print_time(exec, sizeof(exec),
+			times[i].done - times[i].now,
+			times[i].now && times[i].done));
+	}
+
+	free(path);
+	free(level);
+	rc_stringlist_free(one);
+	rc_stringlist_free(deptypes);
+}
+
+static void
+print_times(const SVCTIME *times, size_t n, bool stopping)
+{
+	size_t i;
+	char at[32], wait[32], exec[32], total[32];
+	bool any = false;
+
+	for (i = 0; i < n; i++) {
+		if (times[i].stopping != stopping)
+			continue;
+		if (!any) {
+			printf("%s %-20s %10s %10s %10s %10s\n",
+			    stopping ? "Stopped:" : "Started:", "",
+			    "at", "wait", "exec", "total");
+			any = true;
+		}
+		printf(" %-28s %10s %10s %10s %10s\n", times[i].service,
+		    print_time(at, sizeof(at), times[i].in, true),
+		    print_time(wait, sizeof(wait), times[i].wait, true),
+		    print_time(exec, sizeof(exec),
+			times[i].done - times[i].now,
+			times[i].now && times[i].done),
+		    print_time(total, sizeof(total),
+			times[i].out - times[i].in, times[i].out != 0));
+	}
+	if (any && deptree)
+		print_critical_path(times, n, stopping);
+}
+
+static int
+print_timing(void)
+{
+	RC_TRACE_EVENT *events;
+	SVCTIME *times;
+	size_t nevents, ntimes;
+
+	if (!(events = rc_trace_load(&nevents))) {
+		eerror("%s: no trace to show, is rc_trace enabled?", applet);
+		return 1;
+	}
+	deptree = _rc_deptree_load(0, NULL);
+	times = load_times(events, nevents, &ntimes);
+	print_times(times, ntimes, true);
+	print_times(times, ntimes, false);
+	free(times);
+	rc_trace_free(events, nevents);
+	return 0;
+}
+
+static void
+print_json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", (unsigned char)*str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+static bool first_event;
+
+static void
+print_event_sep(void)
+{
+	printf("%s\n", first_event ? "" : ",");
+	first_event = false;
+}
+
+/* Name a track, keeping them in the order they first appear */
+static void
+print_track(size_t track, const char *name)
+{
+	print_event_sep();
+	printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+	    "\"tid\":%zu,\"args\":{\"name\":", track);
+	print_json_string(name);
+	printf("}}");
+	print_event_sep();
+	printf("{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,"
+	    "\"tid\":%zu,\"args\":{\"sort_index\":%zu}}", track, track);
+}
+
+/* Chrome wants times in microseconds */
+static void
+print_span(size_t track, const char *name, const char *cat,
+    uint64_t from, uint64_t to)
+{
+	if (from == 0 || to < from)
+		return;
+	print_event_sep();
+	printf("{\"name\":");
+	print_json_string(name);
+	printf(",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,"
+	    "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu}",
+	    cat, track,
+	    (unsigned long long)(from / 1000),
+	    (unsigned long long)(from % 1000),
+	    (unsigned long long)((to - from) / 1000),
+	    (unsigned long long)((to - from) % 1000));
+}
+
+static size_t
+svctime_track(const SVCTIME *times, size_t n, const char *service)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (strcmp(times[i].service, service) == 0)
+			break;
+	return i + 1;
+}
+
+/* Print the trace as Chrome trace events, with a track for rc and one
+ * for each service */
+static int
+print_trace_events(void)
+{
+	RC_TRACE_EVENT *events, *e;
+	SVCTIME *times = NULL, *t;
+	size_t i, nevents, ntimes = 0, track;
+	ssize_t k;
+	uint64_t level_in = 0;
+	const char *fn;
+	char name[64];
+
+	if (!(events = rc_trace_load(&nevents))) {
+		eerror("%s: no trace to show, is rc_trace enabled?", applet);
+		return 1;
+	}
+
+	first_event = true;
+	printf("{\"traceEvents\":[");
+	print_event_sep();
+	printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+	    "\"args\":{\"name\":\"openrc\"}}");
+	print_track(0, "rc");
+	for (i = 0; i < nevents; i++) {
+		e = &events[i];
+		k = svctime_find(times, ntimes, e->name);
+		t = k == -1 ? NULL : &times[k];
+		track = svctime_track(times, ntimes, e->name);
+		fn = t && t->stopping ? "stop" : "start";
+		switch (e->point) {
+		case RC_HOOK_RUNLEVEL_STOP_IN:
+		case RC_HOOK_RUNLEVEL_START_IN:
+			level_in = e->time;
+			break;
+		case RC_HOOK_RUNLEVEL_STOP_OUT:
+		case RC_HOOK_RUNLEVEL_START_OUT:
+			snprintf(name, sizeof(name), "%s %s",
+			    e->point == RC_HOOK_RUNLEVEL_STOP_OUT ?
+			    "stop" : "start", e->name);
+			print_span(0, name, "runlevel", level_in, e->time);
+			level_in = 0;
+			break;
+		case RC_HOOK_SERVICE_START_IN:
+		case RC_HOOK_SERVICE_STOP_IN:
+			if (!t)
+				print_track(track, e->name);
+			break;
+		}
+		if (t) {
+			switch (e->point) {
+			case RC_TRACE_WAIT_OUT:
+				print_span(track, "dependency wait", "wait",
+				    t->wait_in, e->time);
+				break;
+			case RC_TRACE_SOURCED:
+				print_span(track, "runscript.sh", fn,
+				    t->now, e->time);
+				break;
+			case RC_TRACE_PRE_OUT:
+				snprintf(name, sizeof(name), "%s_pre", fn);
+				print_span(track, name, fn,
+				    t->sourced, e->time);
+				break;
+			case RC_TRACE_FUNC_OUT:
+				print_span(track, fn, fn,
+				    t->pre ? t->pre : t->sourced, e->time);
+				break;
+			case RC_TRACE_POST_OUT:
+				snprintf(name, sizeof(name), "%s_post", fn);
+				print_span(track, name, fn, t->func, e->time);
+				break;
+			case RC_TRACE_DAEMON_OUT:
+				print_span(track, "start_wait", fn,
+				    t->daemon_in, e->time);
+				break;
+			case RC_HOOK_SERVICE_START_OUT:
+			case RC_HOOK_SERVICE_STOP_OUT:
+				print_span(track, e->name, fn, t->in, e->time);
+				break;
+			}
+		}
+		svctime_event(&times, &ntimes, e);
+	}
+
+	/* Show what was still going when the trace ended */
+	for (i = 0; nevents && i < ntimes; i++)
+		if (!times[i].out)
+			print_span(svctime_track(times, ntimes,
+				times[i].service),
+			    times[i].service, "unfinished",
+			    times[i].in, events[nevents - 1].time);
+	printf("\n],\"displayTimeUnit\":\"ms\"}\n");
+
+	free(times);
+	rc_trace_free(events, nevents);
+	return 0;
+}
+
 #include "_usage.h"
 #define usagestring ""						\
 	"Usage: rc-status [options] <runlevel>...\n"		\
-	"   or: rc-status [options] [-a | -c | -l | -r | -s | -u]"
-#define getoptstring "aclrsu" getoptstring_COMMON
+	"   or: rc-status [options] [-a | -c | -l | -r | -s | -t | -T | -u]"
+#define getoptstring "aclrstTu" getoptstring_COMMON
 static const struct option longopts[] = {
 	{"all",         0, NULL, 'a'},
 	{"crashed",     0, NULL, 'c'},
 	{"list",        0, NULL, 'l'},
 	{"runlevel",    0, NULL, 'r'},
 	{"servicelist", 0, NULL, 's'},
+	{"timing",      0, NULL, 't'},
+	{"trace-events", 0, NULL, 'T'},
 	{"unused",      0, NULL, 'u'},
 	longopts_COMMON
 };
@@ -211,6 +619,8 @@ static const char * const longopts_help[] = {
 	"Show list of run levels",
 	"Show the name of the current runlevel",
 	"Show service list",
+	"Show how long services took in the last runlevel change",
+	"Print the last runlevel change as Chrome trace events",
 	"Show services not assigned to any runlevel",
 	longopts_help_COMMON
 };
@@ -225,6 +635,7 @@ rc_status(int argc, char **argv)
 	int opt, aflag = 0, retval = 0;
 
 	test_crashed = _rc_can_find_pids();
+	states = rc_service_states_load();
 
 	while ((opt = getopt_long(argc, argv, getoptstring, longopts,
 				  (int *) 0)) != -1)
@@ -237,7 +648,7 @@ rc_status(int argc, char **argv)
 			services = rc_services_in_state(RC_SERVICE_STARTED);
 			retval = 1;
 			TAILQ_FOREACH(s, services, entries)
-				if (rc_service_daemons_crashed(s->value)) {
+				if (daemons_crashed(s->value)) {
 					printf("%s\n", s->value);
 					retval = 0;
 				}
@@ -258,6 +669,14 @@ rc_status(int argc, char **argv)
 			print_services(NULL, services);
 			goto exit;
 			/* NOTREACHED */
+		case 't':
+			retval = print_timing();
+			goto exit;
+			/* NOTREACHED */
+		case 'T':
+			retval = print_trace_events();
+			goto exit;
+			/* NOTREACHED */
 		case 'u':
 			services = rc_services_in_runlevel(NULL);
 			levels = rc_runlevel_list();
@@ -335,7 +754,7 @@ rc_status(int argc, char **argv)
 		}
 		TAILQ_FOREACH_SAFE(s, services, entries, t) {
 			if ((rc_stringlist_find(sservices, s->value) ||
-			    (rc_service_state(s->value) & ( RC_SERVICE_STOPPED | RC_SERVICE_HOTPLUGGED)))) {
+			    (rc_service_states_get(states, s->value) & ( RC_SERVICE_STOPPED | RC_SERVICE_HOTPLUGGED)))) {
 				TAILQ_REMOVE(services, s, entries);
 				free(s->value);
 				free(s);
@@ -382,6 +801,8 @@ exit:
 	rc_stringlist_free(types);
 	rc_stringlist_free(levels);
 	rc_deptree_free(deptree);
+	rc_service_states_free(states);
+	rc_procs_free(procs);
 #endif
 
 	return retval;
@@ -0,0 +1,211 @@
+/*
+  rc-trace.c
+  Records when each service passes through each hook so we can see
+  where the time goes in a boot or runlevel change.
+*/
+
+/*
+ * Copyright (c) 2007-2008 Roy Marples <roy@marples.name>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rc.h"
+#include "rc-misc.h"
+#include "rc-trace.h"
+
+#define TRACE_MAGIC		"RCtrace"
+#define TRACE_VERSION		1
+
+typedef struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t time;		/* when the trace began */
+} TRACE_HEADER;
+
+/* Each record is followed by its name, without a NUL.
+ * A record goes out in one write to a file opened O_APPEND, so
+ * records from each service never get mixed up. */
+typedef struct trace_record {
+	uint64_t time;
+	int32_t pid;
+	uint16_t point;
+	uint16_t len;
+} TRACE_RECORD;
+
+static int trace_fd = -1;
+static bool trace_opened;
+
+static uint64_t
+trace_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* rc opens the trace for each runlevel change, starting a new one
+ * if reset. Services only add to it while a runlevel changes. */
+void
+rc_trace_open(bool reset)
+{
+	TRACE_HEADER hdr;
+	struct stat st;
+	int flags = O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC;
+
+	if (trace_fd != -1)
+		close(trace_fd);
+	trace_fd = -1;
+	trace_opened = true;
+
+	if (!rc_conf_yesno("rc_trace")) {
+		if (reset)
+			unlink(RC_TRACE);
+		return;
+	}
+	if (reset)
+		flags |= O_TRUNC;
+	if ((trace_fd = open(RC_TRACE, flags, 0644)) == -1)
+		return;
+	if (fstat(trace_fd, &st) == 0 && st.st_size != 0)
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.time = trace_now();
+	if (write(trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		close(trace_fd);
+		trace_fd = -1;
+	}
+}
+
+bool
+rc_tracing(void)
+{
+	if (!trace_opened) {
+		trace_opened = true;
+		if (rc_runlevel_starting() || rc_runlevel_stopping())
+			trace_fd = open(RC_TRACE, O_WRONLY | O_APPEND | O_CLOEXEC);
+	}
+	return trace_fd != -1;
+}
+
+void
+rc_trace(int point, const char *name)
+{
+	char buf[sizeof(TRACE_RECORD) + NAME_MAX];
+	TRACE_RECORD rec;
+	size_t len = name ? strlen(name) : 0;
+
+	if (!rc_tracing())
+		return;
+
+	if (len > NAME_MAX)
+		len = NAME_MAX;
+	rec.time = trace_now();
+	rec.pid = getpid();
+	rec.point = point;
+	rec.len = len;
+	memcpy(buf, &rec, sizeof(rec));
+	if (len)
+		memcpy(buf + sizeof(rec), name, len);
+	if (write(trace_fd, buf, sizeof(rec) + len) == -1 && errno != EINTR) {
+		close(trace_fd);
+		trace_fd = -1;
+	}
+}
+
+/* Load the events of the last trace, with times relative to when it
+ * began. A record cut short by a crash ends the trace. */
+RC_TRACE_EVENT *
+rc_trace_load(size_t *nevents)
+{
+	char *buffer = NULL, *p, *end;
+	size_t len, n = 0;
+	TRACE_HEADER hdr;
+	TRACE_RECORD rec;
+	RC_TRACE_EVENT *events = NULL;
+
+	*nevents = 0;
+	if (!rc_getfile(RC_TRACE, &buffer, &len))
+		return NULL;
+	/* rc_getfile adds a NUL */
+	end = buffer + len - 1;
+	if (len - 1 < sizeof(hdr)) {
+		free(buffer);
+		return NULL;
+	}
+	memcpy(&hdr, buffer, sizeof(hdr));
+	if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != TRACE_VERSION)
+	{
+		free(buffer);
+		return NULL;
+	}
+
+	for (p = buffer + sizeof(hdr);
+	     (size_t)(end - p) >= sizeof(rec);
+	     p += sizeof(rec) + rec.len)
+	{
+		memcpy(&rec, p, sizeof(rec));
+		if ((size_t)(end - p) < sizeof(rec) + rec.len)
+			break;
+		events = xrealloc(events, sizeof(*events) * (n + 1));
+		events[n].time = rec.time > hdr.time ? rec.time - hdr.time : 0;
+		events[n].pid = rec.pid;
+		events[n].point = rec.point;
+		events[n].name = xmalloc(rec.len + 1);
+		memcpy(events[n].name, p + sizeof(rec), rec.len);
+		events[n].name[rec.len] = '\0';
+		n++;
+	}
+	free(buffer);
+	*nevents = n;
+	return events;
+}
+
+void
+rc_trace_free(RC_TRACE_EVENT *events, size_t nevents)
+{
+	size_t i;
+
+	for (i = 0; events && i < nevents; i++)
+		free(events[i].name);
+	free(events);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2007-2008 Roy Marples <roy@marples.name>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef RC_TRACE_H
+#define RC_TRACE_H
+
+#include <stdint.h>
+
+#define RC_TRACE		RC_SVCDIR "/trace"
+
+/* Points we trace besides the plugin hooks */
+#define RC_TRACE_WAIT_IN	201
+#define RC_TRACE_WAIT_OUT	202
+/* runscript.sh marks its progress through start or stop */
+#define RC_TRACE_SOURCED	203
+#define RC_TRACE_PRE_OUT	204
+#define RC_TRACE_FUNC_OUT	205
+#define RC_TRACE_POST_OUT	206
+/* start-stop-daemon checks the daemon stays up */
+#define RC_TRACE_DAEMON_IN	207
+#define RC_TRACE_DAEMON_OUT	208
+
+typedef struct rc_trace_event {
+	uint64_t time;		/* nanoseconds since the trace began */
+	pid_t pid;
+	int point;		/* RC_HOOK or RC_TRACE_* */
+	char *name;
+} RC_TRACE_EVENT;
+
+void rc_trace_open(bool reset);
+bool rc_tracing(void);
+void rc_trace(int point, const char *name);
+RC_TRACE_EVENT *rc_trace_load(size_t *nevents);
+void rc_trace_free(RC_TRACE_EVENT *events, size_t nevents);
+
+#endif
@@ -358,6 +358,18 @@ rc_update(int argc, char **argv)
 				ewarnx("%s: service `%s' not found in any"
 				    " of the specified runlevels",
 				    applet, service);
+
+			/* Work out the new order of the runlevels now, so
+			 * changing to them doesn't have to */
+			if (num_updated > 0 && (deptree = rc_deptree_load())) {
+				TAILQ_FOREACH(runlevel, runlevels, entries)
+					if (rc_runlevel_exists(runlevel->value))
+						rc_stringlist_free(
+						    rc_deptree_order_runlevel(
+						    deptree, runlevel->value,
+						    RC_DEP_START));
+				rc_deptree_free(deptree);
+			}
 		}
 	}
 
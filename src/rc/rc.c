@@ -50,6 +50,7 @@ const char rc_copyright[] = "Copyright (c) 2007-2008 Roy Marples";
 #include <limits.h>
 #include <pwd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -65,6 +66,7 @@ const char rc_copyright[] = "Copyright (c) 2007-2008 Roy Marples";
 #include "rc-logger.h"
 #include "rc-misc.h"
 #include "rc-plugin.h"
+#include "rc-trace.h"
 
 #include "version.h"
 
@@ -460,6 +462,7 @@ do_sysinit()
 {
 	struct utsname uts;
 	const char *sys;
+	const char *statedb;
 
 	/* exec init-early.sh if it exists
 	 * This should just setup the console to use the correct
@@ -493,6 +496,15 @@ do_sysinit()
 	setenv("RC_RUNLEVEL", RC_LEVEL_SYSINIT, 1);
 	run_program(INITSH);
 
+	/* Now RC_SVCDIR is ready we can keep service state in one file */
+	statedb = rc_conf_value("rc_statedb");
+	if (statedb && strcmp(statedb, "compat") == 0)
+		rc_service_statedb_create(true);
+	else if (rc_yesno(statedb))
+		rc_service_statedb_create(false);
+	else
+		unlink(RC_STATEDB);
+
 	/* init may have mounted /proc so we can now detect or real
 	 * sys */
 	if ((sys = rc_sys()))
@@ -518,6 +530,15 @@ runlevel_config(const char *service, const char *level)
 	return retval;
 }
 
+/* The scheduler for parallel starts and stops is below */
+typedef struct schedsvc SCHEDSVC;
+static SCHEDSVC *sched_new(const RC_DEPTREE *, const RC_STRINGLIST *,
+    const char *, bool, size_t *);
+static void sched_run(SCHEDSVC *, size_t, pid_t (*)(const char *, void *),
+    void *);
+static void sched_free(SCHEDSVC *, size_t);
+static pid_t sched_stop(const char *, void *);
+
 static void
 do_stop_services(const RC_STRINGLIST *types_n, const RC_STRINGLIST *start_services,
 				 const RC_STRINGLIST *stop_services, const RC_DEPTREE *deptree,
@@ -527,8 +548,10 @@ do_stop_services(const RC_STRINGLIST *types_n, const RC_STRINGLIST *start_servic
 	RC_STRING *service, *svc1, *svc2;
 	RC_STRINGLIST *deporder, *tmplist, *kwords;
 	RC_SERVICE state;
-	RC_STRINGLIST *nostop;
+	RC_STRINGLIST *nostop, *stopping;
 	bool crashed, nstop;
+	SCHEDSVC *sched;
+	size_t n;
 
 	if (!types_n) {
 		types_n = rc_stringlist_new();
@@ -538,6 +561,7 @@ do_stop_services(const RC_STRINGLIST *types_n, const RC_STRINGLIST *start_servic
 	crashed = rc_conf_yesno("rc_crashed_stop");
 
 	nostop = rc_stringlist_split(rc_conf_value("rc_nostop"), " ");
+	stopping = rc_stringlist_new();
 	TAILQ_FOREACH_REVERSE(service, stop_services, rc_stringlist, entries)
 	{
 		state = rc_service_state(service->value);
@@ -610,27 +634,310 @@ do_stop_services(const RC_STRINGLIST *types_n, const RC_STRINGLIST *start_servic
 
 stop:
 		/* After all that we can finally stop the blighter! */
+		if (parallel) {
+			rc_stringlist_add(stopping, service->value);
+			continue;
+		}
 		pid = service_stop(service->value);
 		if (pid > 0) {
 			add_pid(pid);
-			if (!parallel) {
-				rc_waitpid(pid);
-				remove_pid(pid);
-			}
+			rc_waitpid(pid);
+			remove_pid(pid);
 		}
 	}
 
+	/* Stop each service once everything which needs or uses it
+	 * has stopped */
+	if (TAILQ_FIRST(stopping)) {
+		sched = sched_new(deptree, stopping,
+		    newlevel ? newlevel : runlevel, true, &n);
+		sched_run(sched, n, sched_stop, NULL);
+		sched_free(sched, n);
+	}
+	rc_stringlist_free(stopping);
 	rc_stringlist_free(nostop);
 }
 
+/* A service rc is going to start or stop in parallel */
+struct schedsvc {
+	const char *service;
+	pid_t pid;
+	bool done;
+	size_t waiting;		/* services before us which are not done */
+	size_t *after;		/* services waiting for us */
+	size_t nafter;
+};
+
+static size_t
+parallel_jobs(void)
+{
+	const char *value = rc_conf_value("rc_parallel_jobs");
+	long jobs = value ? strtol(value, NULL, 10) : 0;
+
+	/* Without a limit everything that is ready runs at once */
+	return jobs < 1 ? SIZE_MAX : (size_t)jobs;
+}
+
+/* Have svc wait for before, which is earlier in the list, so however
+ * the services depend on each other we can't deadlock */
+static void
+sched_before(SCHEDSVC *sched, size_t before, size_t svc, size_t *seen)
+{
+	SCHEDSVC *s = &sched[before];
+
+	if (seen[before] == svc + 1)
+		return;
+	seen[before] = svc + 1;
+	s->after = xrealloc(s->after, sizeof(*s->after) * (s->nafter + 1));
+	s->after[s->nafter++] = svc;
+	sched[svc].waiting++;
+}
+
+static ssize_t
+sched_find(const SCHEDSVC *sched, size_t n, const char *service)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (strcmp(sched[i].service, service) == 0)
+			return i;
+	return -1;
+}
+
+/* Work out which services in the list each one has to wait for.
+ * openrc-run waits for everything it needs, uses or comes after when
+ * starting, and everything which needs or uses it when stopping, all
+ * the way down, so we wait for the same. */
+static SCHEDSVC *
+sched_new(const RC_DEPTREE *deptree, const RC_STRINGLIST *services,
+    const char *level, bool stopping, size_t *nsched)
+{
+	SCHEDSVC *sched;
+	RC_STRING *service, *dep;
+	RC_STRINGLIST *types, *one, *deps;
+	size_t i, j, n = 0, *seen;
+	ssize_t k;
+	int options = RC_DEP_TRACE;
+	bool first, last;
+
+	/* Same options as openrc-run */
+	errno = 0;
+	if (rc_conf_yesno("rc_depend_strict") || errno == ENOENT)
+		options |= RC_DEP_STRICT;
+
+	TAILQ_FOREACH(service, services, entries)
+		n++;
+	sched = xmalloc(sizeof(*sched) * (n ? n : 1));
+	memset(sched, 0, sizeof(*sched) * (n ? n : 1));
+	seen = xmalloc(sizeof(*seen) * (n ? n : 1));
+	memset(seen, 0, sizeof(*seen) * (n ? n : 1));
+	i = 0;
+	TAILQ_FOREACH(service, services, entries)
+		sched[i++].service = service->value;
+
+	types = rc_stringlist_new();
+	if (stopping) {
+		rc_stringlist_add(types, "needsme");
+		rc_stringlist_add(types, "usesme");
+		rc_stringlist_add(types, "ibefore");
+	} else {
+		rc_stringlist_add(types, "ineed");
+		rc_stringlist_add(types, "iuse");
+		rc_stringlist_add(types, "iafter");
+	}
+	one = rc_stringlist_new();
+	for (i = 0; i < n; i++) {
+		rc_stringlist_add(one, sched[i].service);
+		deps = rc_deptree_depends(deptree, types, one, level, options);
+		/* A dependency later in the list is part of a loop.
+		 * openrc-run would wait for it if it was running, so it
+		 * has to wait for us instead. */
+		TAILQ_FOREACH(dep, deps, entries) {
+			if ((k = sched_find(sched, n, dep->value)) == -1)
+				continue;
+			if ((size_t)k < i)
+				sched_before(sched, k, i, seen);
+			else if ((size_t)k > i)
+				sched_before(sched, i, k, seen);
+		}
+		rc_stringlist_free(deps);
+		rc_stringlist_delete(one, sched[i].service);
+
+		/* after * starts after everything else and stops before
+		 * it, before * the other way around */
+		deps = rc_deptree_depend(deptree, sched[i].service, "iafter");
+		last = rc_stringlist_find(deps, "*") != NULL;
+		rc_stringlist_free(deps);
+		deps = rc_deptree_depend(deptree, sched[i].service, "ibefore");
+		first = rc_stringlist_find(deps, "*") != NULL;
+		rc_stringlist_free(deps);
+		if (stopping) {
+			j = first;
+			first = last;
+			last = j;
+		}
+		if (last)
+			for (j = 0; j < i; j++)
+				sched_before(sched, j, i, seen);
+		if (first)
+			for (j = i + 1; j < n; j++)
+				sched_before(sched, i, j, seen);
+	}
+	rc_stringlist_free(one);
+	rc_stringlist_free(types);
+
+	free(seen);
+	*nsched = n;
+	return sched;
+}
+
 static void
-do_start_services(const RC_STRINGLIST *start_services, bool parallel)
+sched_done(SCHEDSVC *sched, size_t i)
+{
+	size_t j;
+
+	sched[i].done = true;
+	sched[i].pid = 0;
+	for (j = 0; j < sched[i].nafter; j++)
+		sched[sched[i].after[j]].waiting--;
+}
+
+static void
+sched_free(SCHEDSVC *sched, size_t n)
+{
+	size_t i;
+
+	for (i = 0; sched && i < n; i++)
+		free(sched[i].after);
+	free(sched);
+}
+
+/* Just wakes sched_run up, it reaps its own children */
+static void
+sched_wake(_unused int sig)
+{
+}
+
+/* Run each service as soon as everything it waits for is done, at most
+ * rc_parallel_jobs at once. run returns the pid to wait for, 0 if there
+ * is nothing to wait for or -1 to stop running any more. */
+static void
+sched_run(SCHEDSVC *sched, size_t n, pid_t (*run)(const char *, void *),
+    void *arg)
+{
+	size_t i, jobs = parallel_jobs(), running = 0;
+	pid_t pid;
+	bool more = true, reaped;
+	sigset_t chld, old;
+
+	/* Only wait for the children we start here, so handle_signal still
+	 * sees any others, such as the logger, once we are done */
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	signal_setup(SIGCHLD, sched_wake);
+	for (;;) {
+		for (i = 0; i < n && running < jobs && more; i++) {
+			if (sched[i].done || sched[i].pid || sched[i].waiting)
+				continue;
+			pid = run(sched[i].service, arg);
+			if (pid > 0) {
+				add_pid(pid);
+				sched[i].pid = pid;
+				running++;
+			} else if (pid == 0)
+				sched_done(sched, i);
+			else
+				more = false;
+		}
+		if (running == 0)
+			break;
+
+		/* Block SIGCHLD while we look, so one which comes after
+		 * still wakes us up */
+		sigprocmask(SIG_BLOCK, &chld, &old);
+		reaped = false;
+		for (i = 0; i < n; i++) {
+			if (!sched[i].pid ||
+			    waitpid(sched[i].pid, NULL, WNOHANG) == 0)
+				continue;
+			remove_pid(sched[i].pid);
+			sched_done(sched, i);
+			running--;
+			reaped = true;
+		}
+		if (!reaped)
+			sigsuspend(&old);
+		sigprocmask(SIG_SETMASK, &old, NULL);
+	}
+	signal_setup(SIGCHLD, handle_signal);
+	/* Let handle_signal reap anything else which exited meanwhile */
+	raise(SIGCHLD);
+}
+
+static pid_t
+sched_stop(const char *service, _unused void *arg)
+{
+	pid_t pid = service_stop(service);
+
+	return pid > 0 ? pid : 0;
+}
+
+static bool
+want_start(const char *service, const RC_SERVICE_STATES *states,
+    bool crashed)
+{
+	RC_SERVICE state;
+
+	state = rc_service_states_get(states, service);
+	if (state & RC_SERVICE_STOPPED)
+		state = rc_service_state(service);
+	if (state & RC_SERVICE_FAILED)
+		return false;
+	if (!(state & RC_SERVICE_STOPPED)) {
+		if (crashed && rc_service_daemons_crashed(service))
+			rc_service_mark(service, RC_SERVICE_STOPPED);
+		else
+			return false;
+	}
+	return true;
+}
+
+struct sched_start {
+	const RC_SERVICE_STATES *states;
+	bool crashed;
+	bool interactive;
+};
+
+/* Stop starting more if the user wants an interactive boot */
+static pid_t
+sched_start(const char *service, void *arg)
+{
+	struct sched_start *start = arg;
+	pid_t pid;
+
+	if ((start->interactive = want_interactive()))
+		return -1;
+	if (!want_start(service, start->states, start->crashed))
+		return 0;
+	/* -1 mostly means another openrc-run holds the lock because it is
+	 * starting us as a dependency. Like the serial loop below we just
+	 * move on, as whatever needs us waits for us itself. */
+	pid = service_start(service);
+	return pid > 0 ? pid : 0;
+}
+
+static void
+do_start_services(const RC_DEPTREE *deptree,
+    const RC_STRINGLIST *start_services, bool parallel)
 {
 	RC_STRING *service;
 	pid_t pid;
 	bool interactive = false;
-	RC_SERVICE state;
+	RC_SERVICE_STATES *states;
 	bool crashed = false;
+	SCHEDSVC *sched = NULL;
+	size_t i, n = 0;
+	struct sched_start start;
 
 	if (!rc_yesno(getenv("EINFO_QUIET")))
 		interactive = exists(INTERACTIVE);
@@ -639,18 +946,27 @@ do_start_services(const RC_STRINGLIST *start_services, bool parallel)
 	if (errno == ENOENT)
 		crashed = true;
 
+	/* Services only get started while we go through the list, as a
+	 * dependency of another one, so only look again at those which
+	 * were stopped when we started */
+	states = rc_service_states_load();
+
+	if (parallel && !interactive) {
+		start.states = states;
+		start.crashed = crashed;
+		start.interactive = false;
+		sched = sched_new(deptree, start_services, runlevel, false, &n);
+		sched_run(sched, n, sched_start, &start);
+		interactive = start.interactive;
+	}
+
+	/* Start whatever is left one at a time */
+	i = 0;
 	TAILQ_FOREACH(service, start_services, entries) {
-		state = rc_service_state(service->value);
-		if (state & RC_SERVICE_FAILED)
+		if (sched && sched[i++].done)
+			continue;
+		if (!want_start(service->value, states, crashed))
 			continue;
-		if (!(state & RC_SERVICE_STOPPED)) {
-			if (crashed &&
-			    rc_service_daemons_crashed(service->value))
-				rc_service_mark(service->value,
-				    RC_SERVICE_STOPPED);
-			else
-			    continue;
-		}
 		if (!interactive)
 			interactive = want_interactive();
 
@@ -684,6 +1000,8 @@ do_start_services(const RC_STRINGLIST *start_services, bool parallel)
 			}
 		}
 	}
+	rc_service_states_free(states);
+	sched_free(sched, n);
 
 	/* Store our interactive status for boot */
 	if (interactive &&
@@ -757,7 +1075,6 @@ main(int argc, char **argv)
 	static RC_STRINGLIST *types_n;
 	static RC_STRINGLIST *types_nua;
 	static RC_DEPTREE *deptree;
-	RC_STRINGLIST *deporder = NULL;
 	RC_STRINGLIST *tmplist;
 	RC_STRING *service;
 	bool going_down = false;
@@ -942,6 +1259,13 @@ main(int argc, char **argv)
 		}
 	}
 
+	/* A boot is traced from sysinit through to the first runlevel
+	 * after boot, anything else on its own */
+	rc_trace_open(!newlevel ||
+	    strcmp(newlevel, RC_LEVEL_SYSINIT) == 0 ||
+	    (strcmp(runlevel, RC_LEVEL_SYSINIT) != 0 &&
+		(!bootlevel || strcmp(runlevel, bootlevel) != 0)));
+
 	if (going_down) {
 #ifdef __FreeBSD__
 		/* FIXME: we shouldn't have todo this */
@@ -1104,15 +1428,12 @@ main(int argc, char **argv)
 		RC_STRING *rlevel;
 		TAILQ_FOREACH_REVERSE(rlevel, runlevel_chain, rc_stringlist, entries)
 		{
-			/* Get a list of all the services in that runlevel */
-			RC_STRINGLIST *run_services = rc_services_in_runlevel(rlevel->value);
+			/* Get the services in that runlevel in the order
+			 * to start them, which rc-update works out ahead */
+			RC_STRINGLIST *run_services = rc_deptree_order_runlevel(deptree, rlevel->value, RC_DEP_START);
 
 			/* Start those services. */
-			rc_stringlist_sort(&run_services);
-			deporder = rc_deptree_depends(deptree, types_nua, run_services, rlevel->value, depoptions | RC_DEP_START);
-			rc_stringlist_free(run_services);
-			run_services = deporder;
-			do_start_services(run_services, parallel);
+			do_start_services(deptree, run_services, parallel);
 
 			/* Wait for our services to finish */
 			wait_for_services();
@@ -1143,8 +1464,11 @@ main(int argc, char **argv)
 	 * we need to delete them so that they are regenerated again in the
 	 * default runlevel as they may depend on things that are now
 	 * available */
-	if (regen && strcmp(runlevel, bootlevel) == 0)
+	if (regen && strcmp(runlevel, bootlevel) == 0) {
 		unlink(RC_DEPTREE_CACHE);
+		unlink(RC_DEPTREE_BIN);
+		unlink(RC_DEPTREE_RAW);
+	}
 
 	return EXIT_SUCCESS;
 }
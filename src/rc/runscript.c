@@ -33,6 +33,8 @@
 #include <sys/file.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
 #include <ctype.h>
@@ -44,6 +46,7 @@
 #include <limits.h>
 #include <poll.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -66,14 +69,18 @@
 #include "rc.h"
 #include "rc-misc.h"
 #include "rc-plugin.h"
+#include "rc-trace.h"
 
 #ifdef HAVE_SELINUX
 #include "rc-selinux.h"
 #endif
 
+extern char **environ;
+
 #define PREFIX_LOCK	RC_SVCDIR "/prefix.lock"
+#define PREFIX_FLUSH	100		/* msecs we hold a partial line */
+#define PREFIX_IOV	64		/* iovecs we write at once */
 
-#define WAIT_INTERVAL	20000000	/* usecs to poll the lock file */
 #define WAIT_TIMEOUT	60		/* seconds until we timeout */
 #define WARN_TIMEOUT	10		/* warn about this every N seconds */
 
@@ -83,10 +90,13 @@ static RC_DEPTREE *deptree;
 static RC_STRINGLIST *applet_list, *services, *tmplist;
 static RC_STRINGLIST *restart_services, *need_services, *use_services;
 static RC_HOOK hook_out;
-static int exclusive_fd = -1, master_tty = -1;
+static int exclusive_fd = -1, master_tty = -1, prefix_lock = -1;
+static char *prefix_line;
+static size_t prefix_len, prefix_size;
 static bool sighup, in_background, deps, dry_run;
 static pid_t service_pid;
 static int signal_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t alarms;
 
 static RC_STRINGLIST *types_b, *types_n, *types_nu, *types_nua, *types_m;
 static RC_STRINGLIST *types_mua = NULL;
@@ -112,6 +122,10 @@ handle_signal(int sig)
 			rc_waitpid(-1);
 		break;
 
+	case SIGALRM:
+		alarms++;
+		break;
+
 	case SIGWINCH:
 		if (master_tty >= 0) {
 			ioctl(fileno(stdout), TIOCGWINSZ, &ws);
@@ -147,11 +161,9 @@ handle_signal(int sig)
 static void
 unhotplug()
 {
-	char file[PATH_MAX];
-
-	snprintf(file, sizeof(file), RC_SVCDIR "/hotplugged/%s", applet);
-	if (exists(file) && unlink(file) != 0)
-		eerror("%s: unlink `%s': %s", applet, file, strerror(errno));
+	if (!rc_service_hotplug_clear(applet))
+		eerror("%s: unable to clear hotplugged: %s",
+		    applet, strerror(errno));
 }
 
 static void
@@ -250,71 +262,184 @@ cleanup(void)
 	free(ibsave);
 	free(service);
 	free(prefix);
+	free(prefix_line);
 	free(runlevel);
 #endif
 }
 
-/* Buffer and lock all output messages so that we get readable content */
-/* FIXME: Use a dynamic lock file that contains the tty/pts as well.
- * For example openrc-pts8.lock or openrc-tty1.lock.
- * Using a static lock file makes no sense, esp. in multi-user environments.
- * Why don't we use (f)printf, as it is thread-safe through POSIX already?
- * Bug: 360013
- */
-static int
-write_prefix(const char *buffer, size_t bytes, bool *prefixed)
+/* Services printing to the same tty share a lock, such as
+ * prefix-pts-8.lock or prefix-tty1.lock.
+ * open() may fail here when running as user, as RC_SVCDIR may not be
+ * writable. */
+static void
+prefix_lock_open(void)
 {
-	size_t i, j;
-	const char *ec = ecolor(ECOLOR_HILITE);
-	const char *ec_normal = ecolor(ECOLOR_NORMAL);
-	ssize_t ret = 0;
-	int fd = fileno(stdout), lock_fd = -1;
+	char file[PATH_MAX], *tty, *p;
+
+	if ((tty = ttyname(fileno(stdout)))) {
+		if (strncmp(tty, "/dev/", 5) == 0)
+			tty += 5;
+		snprintf(file, sizeof(file), RC_SVCDIR "/prefix-%s.lock", tty);
+		for (p = file + strlen(RC_SVCDIR "/prefix-"); *p; p++)
+			if (*p == '/')
+				*p = '-';
+	} else
+		strlcpy(file, PREFIX_LOCK, sizeof(file));
+
+	prefix_lock = open(file, O_WRONLY | O_CREAT | O_CLOEXEC, 0664);
+	if (prefix_lock == -1)
+		ewarnv("Couldn't open the prefix lock, please make sure you have enough permissions");
+}
 
-	/*
-	 * Lock the prefix.
-	 * open() may fail here when running as user, as RC_SVCDIR may not be writable.
-	 */
-	lock_fd = open(PREFIX_LOCK, O_WRONLY | O_CREAT, 0664);
+/* Write out whole lines under the lock so they never get mixed up
+ * with another service's */
+static void
+prefix_writev(struct iovec *iov, int iovcnt)
+{
+	ssize_t bytes;
+	int fd = fileno(stdout);
 
-	if (lock_fd != -1) {
-		while (flock(lock_fd, LOCK_EX) != 0) {
+	if (iovcnt == 0)
+		return;
+	if (prefix_lock != -1) {
+		while (flock(prefix_lock, LOCK_EX) != 0) {
 			if (errno != EINTR) {
 				ewarnv("flock() failed: %s", strerror(errno));
 				break;
 			}
 		}
 	}
-	else
-		ewarnv("Couldn't open the prefix lock, please make sure you have enough permissions");
 
-	for (i = 0; i < bytes; i++) {
-		/* We don't prefix eend calls (cursor up) */
-		if (buffer[i] == '\033' && !*prefixed) {
-			for (j = i + 1; j < bytes; j++) {
-				if (buffer[j] == 'A')
-					*prefixed = true;
-				if (isalpha((unsigned int)buffer[j]))
-					break;
-			}
+	while (iovcnt > 0) {
+		if ((bytes = writev(fd, iov, iovcnt)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		/* Carry on from where a short write left us */
+		for (; iovcnt > 0 && (size_t)bytes >= iov->iov_len; iov++, iovcnt--)
+			bytes -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + bytes;
+			iov->iov_len -= bytes;
+		}
+	}
+
+	if (prefix_lock != -1)
+		flock(prefix_lock, LOCK_UN);
+}
+
+/* Buffer output from the service and prefix each line of it so that we
+ * get readable content. We hold on to a partial line until the rest
+ * arrives, unless flush is set. */
+static void
+write_prefix(const char *buffer, size_t bytes, bool *prefixed, bool flush)
+{
+	struct iovec iov[PREFIX_IOV];
+	const char *ec = ecolor(ECOLOR_HILITE);
+	const char *ec_normal = ecolor(ECOLOR_NORMAL);
+	char *p, *end, *nl, *q;
+	bool cursor;
+	int n = 0;
+
+	if (prefix_len + bytes > prefix_size) {
+		prefix_size = prefix_len + bytes + BUFSIZ;
+		prefix_line = xrealloc(prefix_line, prefix_size);
+	}
+	if (bytes)
+		memcpy(prefix_line + prefix_len, buffer, bytes);
+	prefix_len += bytes;
+
+	p = prefix_line;
+	end = prefix_line + prefix_len;
+	while (p < end) {
+		if (!(nl = memchr(p, '\n', end - p)) && !flush)
+			break;
+		if (n + 5 > PREFIX_IOV) {
+			prefix_writev(iov, n);
+			n = 0;
 		}
 
 		if (!*prefixed) {
-			ret += write(fd, ec, strlen(ec));
-			ret += write(fd, prefix, strlen(prefix));
-			ret += write(fd, ec_normal, strlen(ec_normal));
-			ret += write(fd, "|", 1);
-			*prefixed = true;
+			/* We don't prefix eend calls (cursor up) */
+			cursor = false;
+			if (*p == '\033') {
+				for (q = p + 1; q < end; q++) {
+					if (*q == 'A')
+						cursor = true;
+					if (isalpha((unsigned char)*q))
+						break;
+				}
+			}
+			if (!cursor) {
+				iov[n].iov_base = UNCONST(ec);
+				iov[n++].iov_len = strlen(ec);
+				iov[n].iov_base = prefix;
+				iov[n++].iov_len = strlen(prefix);
+				iov[n].iov_base = UNCONST(ec_normal);
+				iov[n++].iov_len = strlen(ec_normal);
+				iov[n].iov_base = UNCONST("|");
+				iov[n++].iov_len = 1;
+			}
 		}
 
-		if (buffer[i] == '\n')
-			*prefixed = false;
-		ret += write(fd, buffer + i, 1);
+		q = nl ? nl + 1 : end;
+		iov[n].iov_base = p;
+		iov[n++].iov_len = q - p;
+		*prefixed = nl == NULL;
+		p = q;
 	}
+	prefix_writev(iov, n);
 
-	/* Release the lock */
-	close(lock_fd);
+	prefix_len = end - p;
+	memmove(prefix_line, p, prefix_len);
+}
 
-	return ret;
+/* The environment for runscript.sh, with room for the helper fd */
+static char **
+svc_env(bool tracing)
+{
+	char **env;
+	size_t i, n = 0;
+
+	while (environ && environ[n])
+		n++;
+	env = xmalloc(sizeof(char *) * (n + 3));
+	for (i = n = 0; environ && environ[i]; i++)
+		if (strncmp(environ[i], "RC_TRACING=", 11) != 0 &&
+		    strncmp(environ[i], "RC_HELPER_FD=", 13) != 0)
+			env[n++] = environ[i];
+	/* So runscript.sh only marks the trace if there is one */
+	if (tracing)
+		env[n++] = UNCONST("RC_TRACING=YES");
+	env[n] = env[n + 1] = NULL;
+	return env;
+}
+
+/* The child only has to put the pty in place before running
+ * runscript.sh, so posix_spawn can do it without copying our
+ * page tables as fork would */
+static pid_t
+svc_spawn(char **argv, char **env, int slave_tty)
+{
+	posix_spawn_file_actions_t actions;
+	pid_t pid;
+	int r;
+
+	posix_spawn_file_actions_init(&actions);
+	if (slave_tty >= 0) {
+		posix_spawn_file_actions_adddup2(&actions,
+		    slave_tty, STDOUT_FILENO);
+		posix_spawn_file_actions_adddup2(&actions,
+		    slave_tty, STDERR_FILENO);
+	}
+	r = posix_spawn(&pid, argv[0], &actions, NULL, argv, env);
+	posix_spawn_file_actions_destroy(&actions);
+	if (r != 0) {
+		errno = r;
+		return -1;
+	}
+	return pid;
 }
 
 static int
@@ -328,9 +453,10 @@ svc_exec(const char *arg1, const char *arg2)
 	struct pollfd fd[2];
 	int s;
 	char *buffer;
-	size_t bytes;
-	bool prefixed = false;
+	ssize_t bytes;
+	bool prefixed = false, helper;
 	int slave_tty;
+	char *argv[5], **env, **e, hfd[32];
 	sigset_t sigchldmask;
 	sigset_t oldmask;
 
@@ -364,33 +490,45 @@ svc_exec(const char *arg1, const char *arg2)
 			fcntl(slave_tty, F_SETFD, flags | FD_CLOEXEC);
 	}
 
-	service_pid = fork();
+	if (exists(RC_SVCDIR "/runscript.sh"))
+		argv[0] = UNCONST(RC_SVCDIR "/runscript.sh");
+	else
+		argv[0] = UNCONST(RC_LIBEXECDIR "/sh/runscript.sh");
+	argv[1] = service;
+	argv[2] = UNCONST(arg1);
+	argv[3] = UNCONST(arg2);
+	argv[4] = NULL;
+	env = svc_env(rc_tracing());
+
+	/* The applet helper has to be forked from the child */
+	helper = rc_conf_yesno("rc_applet_helper");
+	if (helper)
+		service_pid = fork();
+	else
+		service_pid = svc_spawn(argv, env, slave_tty);
 	if (service_pid == -1)
-		eerrorx("%s: fork: %s", service, strerror(errno));
+		eerrorx("%s: %s: %s", service,
+		    helper ? "fork" : "posix_spawn", strerror(errno));
 	if (service_pid == 0) {
 		if (slave_tty >= 0) {
 			dup2(slave_tty, STDOUT_FILENO);
 			dup2(slave_tty, STDERR_FILENO);
 		}
-
-		if (exists(RC_SVCDIR "/runscript.sh")) {
-			execl(RC_SVCDIR "/runscript.sh",
-			    RC_SVCDIR "/runscript.sh",
-			    service, arg1, arg2, (char *) NULL);
-			eerror("%s: exec `" RC_SVCDIR "/runscript.sh': %s",
-			    service, strerror(errno));
-			_exit(EXIT_FAILURE);
-		} else {
-			execl(RC_LIBEXECDIR "/sh/runscript.sh",
-			    RC_LIBEXECDIR "/sh/runscript.sh",
-			    service, arg1, arg2, (char *) NULL);
-			eerror("%s: exec `" RC_LIBEXECDIR "/sh/runscript.sh': %s",
-			    service, strerror(errno));
-			_exit(EXIT_FAILURE);
+		if ((i = applet_helper()) != -1) {
+			snprintf(hfd, sizeof(hfd), "RC_HELPER_FD=%d", i);
+			for (e = env; *e; e++)
+				;
+			*e = hfd;
 		}
+		execve(argv[0], argv, env);
+		eerror("%s: exec `%s': %s", service, argv[0], strerror(errno));
+		_exit(EXIT_FAILURE);
 	}
+	free(env);
 
 	buffer = xmalloc(sizeof(char) * BUFSIZ);
+	if (master_tty >= 0 && prefix_lock == -1)
+		prefix_lock_open();
 	fd[0].fd = signal_pipe[0];
 	fd[0].events = fd[1].events = POLLIN;
 	fd[0].revents = fd[1].revents = 0;
@@ -401,7 +539,9 @@ svc_exec(const char *arg1, const char *arg2)
 	}
 
 	for (;;) {
-		if ((s = poll(fd, master_tty >= 0 ? 2 : 1, -1)) == -1) {
+		/* Show a partial line if no more of it turns up */
+		if ((s = poll(fd, master_tty >= 0 ? 2 : 1,
+			    prefix_len ? PREFIX_FLUSH : -1)) == -1) {
 			if (errno != EINTR) {
 				eerror("%s: poll: %s",
 				    service, strerror(errno));
@@ -409,10 +549,14 @@ svc_exec(const char *arg1, const char *arg2)
 			}
 		}
 
+		if (s == 0)
+			write_prefix(NULL, 0, &prefixed, true);
 		if (s > 0) {
 			if (fd[1].revents & (POLLIN | POLLHUP)) {
 				bytes = read(master_tty, buffer, BUFSIZ);
-				write_prefix(buffer, bytes, &prefixed);
+				if (bytes > 0)
+					write_prefix(buffer, bytes,
+					    &prefixed, false);
 			}
 
 			/* Only SIGCHLD signals come down this pipe */
@@ -422,6 +566,8 @@ svc_exec(const char *arg1, const char *arg2)
 	}
 
 	free(buffer);
+	if (prefix_len)
+		write_prefix(NULL, 0, &prefixed, true);
 
 	sigemptyset (&sigchldmask);
 	sigaddset (&sigchldmask, SIGCHLD);
@@ -454,10 +600,11 @@ static bool
 svc_wait(const char *svc)
 {
 	char file[PATH_MAX];
-	int fd;
+	int fd, r;
 	bool forever = false;
 	RC_STRINGLIST *keywords;
-	struct timespec interval, timeout, warn;
+	struct itimerval tick;
+	int elapsed = 0;
 
 	/* Some services don't have a timeout, like fsck */
 	keywords = rc_deptree_depend(deptree, svc, "keyword");
@@ -469,44 +616,50 @@ svc_wait(const char *svc)
 	snprintf(file, sizeof(file), RC_SVCDIR "/exclusive/%s",
 	    basename_c(svc));
 
-	interval.tv_sec = 0;
-	interval.tv_nsec = WAIT_INTERVAL;
-	timeout.tv_sec = WAIT_TIMEOUT;
-	timeout.tv_nsec = 0;
-	warn.tv_sec = WARN_TIMEOUT;
-	warn.tv_nsec = 0;
-	for (;;) {
-		fd = open(file, O_RDONLY | O_NONBLOCK);
-		if (fd != -1) {
-			if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
-				close(fd);
-				return true;
-			}
-			close(fd);
-		}
+	fd = open(file, O_RDONLY | O_NONBLOCK);
+	if (fd == -1) {
 		if (errno == ENOENT)
 			return true;
-		if (errno != EWOULDBLOCK)
-			eerrorx("%s: open `%s': %s", applet, file,
-			    strerror(errno));
-		if (nanosleep(&interval, NULL) == -1) {
-			if (errno != EINTR)
-				return false;
-		}
-		if (!forever) {
-			timespecsub(&timeout, &interval, &timeout);
-			if (timeout.tv_sec <= 0)
-				return false;
-			timespecsub(&warn, &interval, &warn);
-			if (warn.tv_sec <= 0) {
+		eerrorx("%s: open `%s': %s", applet, file, strerror(errno));
+	}
+	if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
+		close(fd);
+		return true;
+	}
+
+	/* Block on the lock so we wake as soon as it's released.
+	 * A timer ticking each second interrupts us to count down the
+	 * timeout. */
+	rc_trace(RC_TRACE_WAIT_IN, applet);
+	memset(&tick, 0, sizeof(tick));
+	if (!forever) {
+		alarms = 0;
+		tick.it_interval.tv_sec = tick.it_value.tv_sec = 1;
+		signal_setup(SIGALRM, handle_signal);
+		setitimer(ITIMER_REAL, &tick, NULL);
+	}
+	for (;;) {
+		if ((r = flock(fd, LOCK_SH)) == 0 || errno != EINTR)
+			break;
+		if (forever)
+			continue;
+		for (; elapsed < alarms; elapsed++) {
+			if (elapsed + 1 >= WAIT_TIMEOUT)
+				break;
+			if ((elapsed + 1) % WARN_TIMEOUT == 0)
 				ewarn("%s: waiting for %s (%d seconds)",
-				    applet, svc, (int)timeout.tv_sec);
-				warn.tv_sec = WARN_TIMEOUT;
-				warn.tv_nsec = 0;
-			}
+				    applet, svc, WAIT_TIMEOUT - elapsed - 1);
 		}
+		if (elapsed < alarms)
+			break;
+	}
+	if (!forever) {
+		memset(&tick, 0, sizeof(tick));
+		setitimer(ITIMER_REAL, &tick, NULL);
 	}
-	return false;
+	close(fd);
+	rc_trace(RC_TRACE_WAIT_OUT, applet);
+	return r == 0;
 }
 
 static void
@@ -39,11 +39,14 @@
 #define ONE_MS           1000000
 
 #include <sys/types.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <termios.h>
 #include <sys/time.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #ifdef __linux__
@@ -56,6 +59,7 @@
 #include <getopt.h>
 #include <limits.h>
 #include <grp.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stddef.h>
@@ -77,6 +81,7 @@ static struct pam_conv conv = { NULL, NULL};
 #include "queue.h"
 #include "rc.h"
 #include "rc-misc.h"
+#include "rc-trace.h"
 
 typedef struct scheduleitem
 {
@@ -97,6 +102,12 @@ static char **nav;
 extern const char *applet;
 static char *changeuser, *ch_root, *ch_dir;
 
+#define MANIFEST_JOBS	8	/* daemons we start or stop at once */
+#define MANIFEST_LOCK	RC_SVCDIR "/daemons.lock"
+
+static bool batched;		/* we are one record of a manifest */
+static RC_PROCS *procs;		/* shared look at the processes running */
+
 extern char **environ;
 
 #if !defined(SYS_ioprio_set) && defined(__NR_ioprio_set)
@@ -113,6 +124,105 @@ static inline int ioprio_set(int which, int who, int ioprio)
 }
 #endif
 
+#if defined(SYS_pidfd_open) && defined(SYS_pidfd_send_signal)
+/* Hold a pidfd for each process we signal, so further signals can only
+ * reach that process and we can poll for it to exit */
+# define HAVE_PIDFD
+
+typedef struct stop_pidfd {
+	pid_t pid;
+	int fd;
+	bool gone;
+} STOP_PIDFD;
+
+static STOP_PIDFD *pidfds;
+static size_t npidfds;
+static bool pidfds_missing;	/* something we couldn't get a pidfd for */
+
+static void
+pidfd_clear(void)
+{
+	size_t i;
+
+	for (i = 0; i < npidfds; i++)
+		close(pidfds[i].fd);
+	free(pidfds);
+	pidfds = NULL;
+	npidfds = 0;
+	pidfds_missing = false;
+}
+
+static int
+pidfd_get(pid_t pid)
+{
+	size_t i;
+	int fd;
+
+	/* A pid whose process has gone may have been reused by another one
+	 * we look for */
+	for (i = 0; i < npidfds; i++)
+		if (pidfds[i].pid == pid && !pidfds[i].gone)
+			return pidfds[i].fd;
+	if ((fd = syscall(SYS_pidfd_open, pid, 0)) == -1) {
+		if (errno != ESRCH)
+			pidfds_missing = true;
+		return -1;
+	}
+	pidfds = xrealloc(pidfds, sizeof(*pidfds) * (npidfds + 1));
+	pidfds[npidfds].pid = pid;
+	pidfds[npidfds].fd = fd;
+	pidfds[npidfds++].gone = false;
+	return fd;
+}
+
+/* Wait up to msecs for any of the processes we signalled to exit.
+ * Returns how many did, 0 on timeout or -1 on error. */
+static int
+pidfd_wait(int msecs)
+{
+	struct pollfd *fds;
+	size_t i, j, n = 0;
+	int r;
+
+	fds = xmalloc(sizeof(*fds) * (npidfds ? npidfds : 1));
+	for (i = 0; i < npidfds; i++) {
+		if (pidfds[i].gone)
+			continue;
+		fds[n].fd = pidfds[i].fd;
+		fds[n].events = POLLIN;
+		fds[n++].revents = 0;
+	}
+	r = poll(fds, n, msecs);
+	for (i = 0; r > 0 && i < n; i++) {
+		if (!fds[i].revents)
+			continue;
+		for (j = 0; j < npidfds; j++)
+			if (pidfds[j].fd == fds[i].fd)
+				pidfds[j].gone = true;
+	}
+	free(fds);
+	return r;
+}
+#endif
+
+static int
+stop_kill(pid_t pid, int sig)
+{
+#ifdef HAVE_PIDFD
+	int fd;
+
+	if ((fd = pidfd_get(pid)) != -1) {
+		if (syscall(SYS_pidfd_send_signal, fd, sig, NULL, 0) == 0)
+			return 0;
+		/* If our process has gone, anything with its pid now
+		 * matched what we look for */
+		if (errno != ESRCH)
+			return -1;
+	}
+#endif
+	return kill(pid, sig);
+}
+
 static void
 free_schedulelist(void)
 {
@@ -334,7 +444,16 @@ do_stop(const char *exec, const char *const *argv,
 	bool killed;
 	int nkilled = 0;
 
-	if (pid)
+	/* A snapshot only helps the first look, after that we need to
+	 * see the processes go */
+	if (procs) {
+		if (pid)
+			pids = rc_procs_find(procs, NULL, NULL, 0, pid);
+		else
+			pids = rc_procs_find(procs, exec, argv, uid, pid);
+		rc_procs_free(procs);
+		procs = NULL;
+	} else if (pid)
 		pids = rc_find_pids(NULL, NULL, 0, pid);
 	else
 		pids = rc_find_pids(exec, argv, uid, pid);
@@ -349,7 +468,7 @@ do_stop(const char *exec, const char *const *argv,
 		} else {
 			ebeginv("Sending signal %d to PID %d", sig, pi->pid);
 			errno = 0;
-			killed = (kill(pi->pid, sig) == 0 ||
+			killed = (stop_kill(pi->pid, sig) == 0 ||
 			    errno == ESRCH ? true : false);
 			eendv(killed ? 0 : 1,
 				"%s: failed to send signal %d to PID %d: %s",
@@ -368,6 +487,51 @@ do_stop(const char *exec, const char *const *argv,
 	return nkilled;
 }
 
+#ifdef HAVE_PIDFD
+/* Wait up to a second for the processes we signalled to go, polling just
+ * their pidfds. Returns how many are still running, or -1 if we have to
+ * look for them instead as we couldn't get a pidfd for each one. */
+static int
+pidfd_wait_second(bool *progressed)
+{
+	struct timespec now, end;
+	long msecs;
+	size_t i;
+	int nrunning;
+
+	if (pidfds_missing || npidfds == 0)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec++;
+	for (;;) {
+		nrunning = 0;
+		for (i = 0; i < npidfds; i++)
+			if (!pidfds[i].gone)
+				nrunning++;
+		if (nrunning == 0)
+			return 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		msecs = (end.tv_sec - now.tv_sec) * 1000 +
+		    (end.tv_nsec - now.tv_nsec) / ONE_MS;
+		if (msecs <= 0)
+			return nrunning;
+		if (pidfd_wait(msecs) == -1) {
+			if (*progressed) {
+				printf("\n");
+				*progressed = false;
+			}
+			if (errno != EINTR) {
+				eerror("%s: poll: %s", applet, strerror(errno));
+				return -1;
+			}
+			eerror("%s: caught an interrupt", applet);
+		}
+	}
+}
+#endif
+
 static int
 run_stop_schedule(const char *exec, const char *const *argv,
     const char *pidfile, uid_t uid,
@@ -407,6 +571,9 @@ run_stop_schedule(const char *exec, const char *const *argv,
 			return 0;
 	}
 
+#ifdef HAVE_PIDFD
+	pidfd_clear();
+#endif
 	while (item) {
 		switch (item->type) {
 		case SC_GOTO:
@@ -439,6 +606,15 @@ run_stop_schedule(const char *exec, const char *const *argv,
 			ts.tv_nsec = POLL_INTERVAL;
 
 			for (nsecs = 0; nsecs < item->value; nsecs++) {
+#ifdef HAVE_PIDFD
+				if (!test && (nrunning = pidfd_wait_second(
+					    &progressed)) != -1)
+				{
+					if (nrunning == 0)
+						return 0;
+					goto second;
+				}
+#endif
 				for (nloops = 0;
 				     nloops < ONE_SECOND / POLL_INTERVAL;
 				     nloops++)
@@ -463,6 +639,9 @@ run_stop_schedule(const char *exec, const char *const *argv,
 						}
 					}
 				}
+#ifdef HAVE_PIDFD
+second:
+#endif
 				if (progress) {
 					printf(".");
 					fflush(stdout);
@@ -580,11 +759,387 @@ expand_home(const char *home, const char *path)
 	return nh;
 }
 
+/* How the daemon tells us it is ready to serve, if it can */
+typedef enum {
+	NOTIFY_NONE,
+	NOTIFY_FD,	/* writes anything to an fd it inherits */
+	NOTIFY_SOCKET	/* sends READY=1 to $NOTIFY_SOCKET */
+} NOTIFY_TYPE;
+
+#define NOTIFY_TIMEOUT	60000	/* ms, unless --wait says otherwise */
+
+static NOTIFY_TYPE notify = NOTIFY_NONE;
+static int notify_fdnum = -1;	/* the fd the daemon writes to */
+static int notify_fd = -1;	/* where we read from */
+static int notify_child = -1;	/* what the daemon inherits */
+static char notify_path[PATH_MAX];
+
+static void
+parse_notify(const char *arg)
+{
+	char *end;
+
+	if (strcmp(arg, "socket") == 0) {
+		notify = NOTIFY_SOCKET;
+		return;
+	}
+	if (strncmp(arg, "fd:", 3) == 0) {
+		errno = 0;
+		notify_fdnum = (int)strtol(arg + 3, &end, 10);
+		if (errno == 0 && end != arg + 3 && *end == '\0' &&
+		    notify_fdnum > STDERR_FILENO)
+		{
+			notify = NOTIFY_FD;
+			return;
+		}
+	}
+	eerrorx("%s: invalid notify type `%s'", applet, arg);
+}
+
+/* Make our end before we fork, so the daemon cannot be ready before
+ * we are listening */
+static void
+notify_open(uid_t uid, gid_t gid)
+{
+	int fds[2];
+	struct sockaddr_un sun;
+
+	if (notify == NOTIFY_FD) {
+		if (pipe(fds) == -1)
+			eerrorx("%s: pipe: %s", applet, strerror(errno));
+		fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+		notify_fd = fds[0];
+		notify_child = fds[1];
+		return;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(notify_path, sizeof(notify_path),
+	    RC_SVCDIR "/tmp/notify.%d", getpid());
+	if (strlen(notify_path) >= sizeof(sun.sun_path))
+		eerrorx("%s: `%s' is too long for a socket",
+		    applet, notify_path);
+	strcpy(sun.sun_path, notify_path);
+	unlink(notify_path);
+	if ((notify_fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1)
+		eerrorx("%s: socket: %s", applet, strerror(errno));
+	fcntl(notify_fd, F_SETFD, FD_CLOEXEC);
+	if (bind(notify_fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		eerrorx("%s: bind `%s': %s",
+		    applet, notify_path, strerror(errno));
+	if ((uid || gid) && chown(notify_path, uid, gid) == -1)
+		eerrorx("%s: chown `%s': %s",
+		    applet, notify_path, strerror(errno));
+}
+
+/* In the child, hand the daemon its end before other fds are closed */
+static void
+notify_setup(void)
+{
+	if (notify == NOTIFY_FD) {
+		if (notify_child == notify_fdnum)
+			return;
+		if (dup2(notify_child, notify_fdnum) == -1)
+			eerrorx("%s: dup2 %d: %s",
+			    applet, notify_fdnum, strerror(errno));
+		close(notify_child);
+	} else if (notify == NOTIFY_SOCKET)
+		setenv("NOTIFY_SOCKET", notify_path, 1);
+}
+
+static void
+notify_close(void)
+{
+	if (notify_fd != -1)
+		close(notify_fd);
+	notify_fd = -1;
+	if (notify_child != -1)
+		close(notify_child);
+	notify_child = -1;
+	if (*notify_path) {
+		unlink(notify_path);
+		*notify_path = '\0';
+	}
+}
+
+/* A datagram holds newline separated assignments */
+static bool
+notify_ready(char *msg)
+{
+	char *line;
+
+	while ((line = strsep(&msg, "\n")))
+		if (strcmp(line, "READY=1") == 0)
+			return true;
+	return false;
+}
+
+/* Block until the daemon says it is ready, it dies or we time out.
+ * We can only tell it died when it is our child, otherwise the pipe
+ * closing tells us for --notify fd. */
+static bool
+notify_wait(const char *exec, unsigned int msecs, pid_t pid, bool background)
+{
+	struct pollfd pfd;
+	struct timespec now, end;
+	char buf[BUFSIZ];
+	ssize_t bytes;
+	int timeout;
+
+	/* Only the daemon should hold the write end now */
+	if (notify_child != -1) {
+		close(notify_child);
+		notify_child = -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += msecs / 1000;
+	end.tv_nsec += (msecs % 1000) * ONE_MS;
+	if (end.tv_nsec >= ONE_SECOND) {
+		end.tv_sec++;
+		end.tv_nsec -= ONE_SECOND;
+	}
+	pfd.fd = notify_fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		if (background && kill(pid, 0) == -1 && errno == ESRCH) {
+			eerror("%s: %s died", applet, exec);
+			return false;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = (end.tv_sec - now.tv_sec) * 1000 +
+		    (end.tv_nsec - now.tv_nsec) / ONE_MS;
+		if (timeout <= 0) {
+			eerror("%s: %s did not say it was ready in %u ms",
+			    applet, exec, msecs);
+			return false;
+		}
+		switch (poll(&pfd, 1, timeout)) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			eerror("%s: poll: %s", applet, strerror(errno));
+			return false;
+		case 0:
+			continue;
+		}
+		bytes = read(notify_fd, buf, sizeof(buf) - 1);
+		if (bytes == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			eerror("%s: read: %s", applet, strerror(errno));
+			return false;
+		}
+		if (notify == NOTIFY_FD) {
+			if (bytes == 0)
+				eerror("%s: %s closed fd %d before it was ready",
+				    applet, exec, notify_fdnum);
+			return bytes > 0;
+		}
+		buf[bytes] = '\0';
+		if (notify_ready(buf))
+			return true;
+	}
+}
+
+/* Daemons of one service can start and stop together from a manifest,
+ * so each has to see the others' records */
+static void
+daemon_set(const char *svcname, const char *exec, const char *const *argv,
+    const char *pidfile, bool started)
+{
+	int fd = -1;
+
+	if (batched &&
+	    (fd = open(MANIFEST_LOCK, O_WRONLY | O_CREAT | O_CLOEXEC,
+		0664)) != -1)
+	{
+		while (flock(fd, LOCK_EX) == -1 && errno == EINTR)
+			;
+	}
+	rc_service_daemon_set(svcname, exec, argv, pidfile, started);
+	if (fd != -1)
+		close(fd);
+}
+
+typedef struct manifest_record {
+	char *line;
+	char **args;
+	int nargs;
+} MANIFEST_RECORD;
+
+/* Split a manifest record into our arguments after the mode.
+ * Quotes group words, but there are no escapes. */
+static char **
+manifest_args(char *line, const char *mode, int *nargs)
+{
+	char **args;
+	char *p = line, *q, quote;
+	int n = 2, size = 8;
+	bool more;
+
+	args = xmalloc(sizeof(*args) * size);
+	args[0] = UNCONST(applet);
+	args[1] = UNCONST(mode);
+	for (;;) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '\0' || *p == '#')
+			break;
+		if (n + 2 > size) {
+			size *= 2;
+			args = xrealloc(args, sizeof(*args) * size);
+		}
+		args[n++] = q = p;
+		for (quote = '\0'; *p; p++) {
+			if (quote) {
+				if (*p == quote) {
+					quote = '\0';
+					continue;
+				}
+			} else if (*p == '\'' || *p == '"') {
+				quote = *p;
+				continue;
+			} else if (*p == ' ' || *p == '\t')
+				break;
+			*q++ = *p;
+		}
+		more = *p != '\0';
+		*q = '\0';
+		if (more)
+			p++;
+	}
+	if (n == 2) {
+		free(args);
+		return NULL;
+	}
+	args[n] = NULL;
+	*nargs = n;
+	return args;
+}
+
+static bool
+manifest_reap(void)
+{
+	int status;
+
+	while (wait(&status) == -1)
+		if (errno != EINTR) {
+			eerror("%s: wait: %s", applet, strerror(errno));
+			return false;
+		}
+	return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+/* Read every record of the manifest before we start any of them, so no
+ * child ever shares the stream with us */
+static MANIFEST_RECORD *
+manifest_read(const char *file, const char *mode, size_t *count)
+{
+	FILE *fp;
+	MANIFEST_RECORD *records = NULL;
+	char *line = NULL;
+	char *copy;
+	char **args;
+	size_t len = 0, n = 0, size = 0;
+	int nargs;
+
+	if (strcmp(file, "-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(file, "r")) == NULL)
+		eerrorx("%s: fopen `%s': %s", applet, file, strerror(errno));
+
+	while (!feof(fp)) {
+		if (rc_getline(&line, &len, fp) == 0)
+			continue;
+		copy = xstrdup(line);
+		if ((args = manifest_args(copy, mode, &nargs)) == NULL) {
+			free(copy);
+			continue;
+		}
+		if (n == size) {
+			size = size ? size * 2 : 16;
+			records = xrealloc(records, sizeof(*records) * size);
+		}
+		records[n].line = copy;
+		records[n].args = args;
+		records[n].nargs = nargs;
+		n++;
+	}
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	*count = n;
+	return records;
+}
+
+/* Start or stop each daemon listed in the manifest, a batch at a time.
+ * Each record is handled by a child as if it had been given to us on
+ * the command line, sharing what we already read. */
+static int
+run_manifest(const char *file, const char *mode, int jobs)
+{
+	MANIFEST_RECORD *records;
+	size_t count, i = 0;
+	int running, status;
+	int retval = EXIT_SUCCESS;
+	pid_t pid = 0;
+
+	records = manifest_read(file, mode, &count);
+
+	/* Load rc.conf once for every daemon */
+	rc_conf_value("rc_start_wait");
+
+	while (i < count && pid != -1) {
+		/* The batch shares one look at the processes, taken once
+		 * the last batch has started or stopped its daemons */
+		procs = rc_procs_new();
+		for (running = 0; running < jobs && i < count; running++, i++) {
+			fflush(stdout);
+			fflush(stderr);
+			if ((pid = fork()) == -1) {
+				eerror("%s: fork: %s", applet, strerror(errno));
+				retval = EXIT_FAILURE;
+				break;
+			}
+			if (pid == 0) {
+				batched = true;
+				/* Have getopt_long start again from scratch */
+#ifdef __GLIBC__
+				optind = 0;
+#else
+				optreset = 1;
+				optind = 1;
+#endif
+				status = start_stop_daemon(records[i].nargs,
+				    records[i].args);
+				fflush(stdout);
+				fflush(stderr);
+				_exit(status);
+			}
+		}
+		for (; running > 0; running--)
+			if (!manifest_reap())
+				retval = EXIT_FAILURE;
+		rc_procs_free(procs);
+		procs = NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		free(records[i].args);
+		free(records[i].line);
+	}
+	free(records);
+	return retval;
+}
+
 #include "_usage.h"
-#define getoptstring "I:KN:PR:Sa:bc:d:e:g:ik:mn:op:s:tu:r:w:x:1:2:" getoptstring_COMMON
+#define getoptstring "I:KM:N:PR:Sa:bc:d:e:g:ij:k:mn:op:s:tu:r:w:x:y:1:2:" getoptstring_COMMON
 static const struct option longopts[] = {
 	{ "ionice",       1, NULL, 'I'},
 	{ "stop",         0, NULL, 'K'},
+	{ "manifest",     1, NULL, 'M'},
 	{ "nicelevel",    1, NULL, 'N'},
 	{ "retry",        1, NULL, 'R'},
 	{ "start",        0, NULL, 'S'},
@@ -596,6 +1151,7 @@ static const struct option longopts[] = {
 	{ "umask",        1, NULL, 'k'},
 	{ "group",        1, NULL, 'g'},
 	{ "interpreted",  0, NULL, 'i'},
+	{ "jobs",         1, NULL, 'j'},
 	{ "make-pidfile", 0, NULL, 'm'},
 	{ "name",         1, NULL, 'n'},
 	{ "oknodo",       0, NULL, 'o'},
@@ -606,6 +1162,7 @@ static const struct option longopts[] = {
 	{ "chroot",       1, NULL, 'r'},
 	{ "wait",         1, NULL, 'w'},
 	{ "exec",         1, NULL, 'x'},
+	{ "notify",       1, NULL, 'y'},
 	{ "stdout",       1, NULL, '1'},
 	{ "stderr",       1, NULL, '2'},
 	{ "progress",     0, NULL, 'P'},
@@ -614,6 +1171,7 @@ static const struct option longopts[] = {
 static const char * const longopts_help[] = {
 	"Set an ionice class:data when starting",
 	"Stop daemon",
+	"Start or stop the daemons listed in this file",
 	"Set a nicelevel when starting",
 	"Retry schedule to use when stopping",
 	"Start daemon",
@@ -625,6 +1183,7 @@ static const char * const longopts_help[] = {
 	"Set the umask for the daemon",
 	"Change the process group",
 	"Match process name by interpreter",
+	"Daemons to start or stop at once from a manifest",
 	"Create a pidfile",
 	"Match process name",
 	"deprecated",
@@ -635,6 +1194,7 @@ static const char * const longopts_help[] = {
 	"Chroot to this directory",
 	"Milliseconds to wait for daemon start",
 	"Binary to start/stop",
+	"Wait for the daemon to say it is ready (fd:N or socket)",
 	"Redirect stdout to file",
 	"Redirect stderr to file",
 	"Print dots each second while waiting",
@@ -697,6 +1257,9 @@ start_stop_daemon(int argc, char **argv)
 	mode_t numask = 022;
 	char **margv;
 	unsigned int start_wait = 0;
+	char *manifest = NULL;
+	int jobs = MANIFEST_JOBS;
+	bool daemon_opts = false;
 
 	TAILQ_INIT(&schedule);
 #ifdef DEBUG_MEMORY
@@ -729,6 +1292,10 @@ start_stop_daemon(int argc, char **argv)
 
 	while ((opt = getopt_long(argc, argv, getoptstring, longopts,
 		    (int *) 0)) != -1)
+	{
+		/* Only these apply to a whole manifest */
+		if (!strchr("KMSjt" getoptstring_COMMON, opt))
+			daemon_opts = true;
 		switch (opt) {
 		case 'I': /* --ionice */
 			if (sscanf(optarg, "%d:%d", &ionicec, &ioniced) == 0)
@@ -745,6 +1312,10 @@ start_stop_daemon(int argc, char **argv)
 			stop = true;
 			break;
 
+		case 'M':  /* --manifest <file> */
+			manifest = optarg;
+			break;
+
 		case 'N':  /* --nice */
 			if (sscanf(optarg, "%d", &nicelevel) != 1)
 				eerrorx("%s: invalid nice level `%s'",
@@ -833,6 +1404,12 @@ start_stop_daemon(int argc, char **argv)
 			interpreted = true;
 			break;
 
+		case 'j':  /* --jobs <n> */
+			if (sscanf(optarg, "%d", &jobs) != 1 || jobs < 1)
+				eerrorx("%s: invalid number of jobs `%s'",
+				    applet, optarg);
+			break;
+
 		case 'k':
 			if (parse_mode(&numask, optarg))
 				eerrorx("%s: invalid mode `%s'",
@@ -883,6 +1460,10 @@ start_stop_daemon(int argc, char **argv)
 			exec = optarg;
 			break;
 
+		case 'y':  /* --notify fd:N|socket */
+			parse_notify(optarg);
+			break;
+
 		case '1':   /* --stdout /path/to/stdout.lgfile */
 			redirect_stdout = optarg;
 			break;
@@ -893,11 +1474,23 @@ start_stop_daemon(int argc, char **argv)
 
 		case_RC_COMMON_GETOPT
 		}
+	}
 
 	endpwent();
 	argc -= optind;
 	argv += optind;
 
+	if (manifest) {
+		if (*argv || daemon_opts)
+			eerrorx("%s: the daemons and their options are"
+			    " listed in `%s'", applet, manifest);
+		if (!start && !stop)
+			eerrorx("%s: --manifest needs --start or --stop",
+			    applet);
+		exit(run_manifest(manifest, stop ? "--stop" : "--start",
+			jobs));
+	}
+
 	/* Allow start-stop-daemon --signal HUP --exec /usr/sbin/dnsmasq
 	 * instead of forcing --stop --oknodo as well */
 	if (!start &&
@@ -924,6 +1517,13 @@ start_stop_daemon(int argc, char **argv)
 	else if (exec)
 		*--argv = exec;
 
+	/* A manifest says how to start each daemon as well */
+	if (batched && (stop || sig != -1)) {
+		background = makepidfile = false;
+		redirect_stdout = redirect_stderr = NULL;
+		notify = NOTIFY_NONE;
+	}
+
 	if (stop || sig != -1) {
 		if (sig == -1)
 			sig = SIGTERM;
@@ -939,6 +1539,9 @@ start_stop_daemon(int argc, char **argv)
 		if (redirect_stdout || redirect_stderr)
 			eerrorx("%s: --stdout and --stderr are only relevant"
 			    " with --start", applet);
+		if (notify != NOTIFY_NONE)
+			eerrorx("%s: --notify is only relevant with"
+			    " --start", applet);
 	} else {
 		if (!exec)
 			eerrorx("%s: nothing to start", applet);
@@ -948,6 +1551,9 @@ start_stop_daemon(int argc, char **argv)
 		if ((redirect_stdout || redirect_stderr) && !background)
 			eerrorx("%s: --stdout and --stderr are only relevant"
 			    " with --background", applet);
+		if (notify == NOTIFY_SOCKET && ch_root)
+			eerrorx("%s: --notify socket cannot be used with"
+			    " --chroot", applet);
 	}
 
 	/* Expand ~ */
@@ -1055,7 +1661,7 @@ start_stop_daemon(int argc, char **argv)
 		if (pidfile && exists(pidfile))
 			unlink(pidfile);
 		if (svcname)
-			rc_service_daemon_set(svcname, exec,
+			daemon_set(svcname, exec,
 			    (const char *const *)argv,
 			    pidfile, false);
 		exit(EXIT_SUCCESS);
@@ -1105,6 +1711,9 @@ start_stop_daemon(int argc, char **argv)
 	if (background)
 		signal_setup(SIGCHLD, handle_signal);
 
+	if (notify != NOTIFY_NONE)
+		notify_open(uid, gid);
+
 	if ((pid = fork()) == -1)
 		eerrorx("%s: fork: %s", applet, strerror(errno));
 
@@ -1269,8 +1878,10 @@ start_stop_daemon(int argc, char **argv)
 		if (background || redirect_stderr || rc_yesno(getenv("EINFO_QUIET")))
 			dup2(stderr_fd, STDERR_FILENO);
 
+		notify_setup();
 		for (i = getdtablesize() - 1; i >= 3; --i)
-			close(i);
+			if (i != notify_fdnum)
+				close(i);
 
 		setsid();
 		execvp(exec, argv);
@@ -1299,14 +1910,31 @@ start_stop_daemon(int argc, char **argv)
 		} while (!WIFEXITED(i) && !WIFSIGNALED(i));
 		if (!WIFEXITED(i) || WEXITSTATUS(i) != 0) {
 			eerror("%s: failed to start `%s'", applet, exec);
+			notify_close();
 			exit(EXIT_FAILURE);
 		}
 		pid = spid;
 	}
 
+	/* A daemon that tells us when it is ready needs no guessing */
+	if (notify != NOTIFY_NONE) {
+		bool ready;
+
+		if (svcname)
+			rc_trace(RC_TRACE_DAEMON_IN, svcname);
+		ready = notify_wait(exec, start_wait > 0 ?
+		    start_wait : NOTIFY_TIMEOUT, pid, background);
+		notify_close();
+		if (svcname)
+			rc_trace(RC_TRACE_DAEMON_OUT, svcname);
+		if (!ready)
+			exit(EXIT_FAILURE);
+		start_wait = 0;
+	}
+
 	/* Wait a little bit and check that process is still running
 	   We do this as some badly written daemons fork and then barf */
-	if (start_wait == 0 &&
+	if (notify == NOTIFY_NONE && start_wait == 0 &&
 	    ((p = getenv("SSD_STARTWAIT")) ||
 		(p = rc_conf_value("rc_start_wait"))))
 	{
@@ -1320,6 +1948,8 @@ start_stop_daemon(int argc, char **argv)
 
 		ts.tv_sec = start_wait / 1000;
 		ts.tv_nsec = (start_wait % 1000) * ONE_MS;
+		if (svcname)
+			rc_trace(RC_TRACE_DAEMON_IN, svcname);
 		if (nanosleep(&ts, NULL) == -1) {
 			if (errno == EINTR)
 				eerror("%s: caught an interrupt", applet);
@@ -1348,12 +1978,14 @@ start_stop_daemon(int argc, char **argv)
 				alive = true;
 		}
 
+		if (svcname)
+			rc_trace(RC_TRACE_DAEMON_OUT, svcname);
 		if (!alive)
 			eerrorx("%s: %s died", applet, exec);
 	}
 
 	if (svcname)
-		rc_service_daemon_set(svcname, exec,
+		daemon_set(svcname, exec,
 		    (const char *const *)margv, pidfile, true);
 
 	exit(EXIT_SUCCESS);